@@ -2,8 +2,17 @@
 #define INSANE_H
 
 #include <linux/types.h>
+#include <linux/bio.h>
 #include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/mempool.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 3, 2, 0 )
+#include <linux/llist.h>
+#define INSANE_DEFER_PARITY
+#endif
 
 #define DM_MSG_PREFIX "insane:"
 #define DM_IO_ERROR_THRESHOLD 15
@@ -17,13 +26,92 @@
 #define dm_log(fmt, args...) printk( DM_MSG_PREFIX " [%s:%d] " fmt, __FUNCTION__, __LINE__, ##args )
 #define dm_debug(fmt, args...) if(debug) { dm_log(fmt, ##args); }
 
+// Precomputed reciprocal of 32-bit divisor.
+// Quotient is computed with multiplication and shifts (Granlund-Montgomery),
+// so per-bio mapping doesn't hit hardware division. See insane_div_init().
+struct insane_divisor
+{
+	u64 magic;    // Low 64 bits of 65-bit multiplier, 0 for power of 2
+	u32 divisor;
+	u8  shift;
+};
+
+void insane_div_init(struct insane_divisor *div, u32 divisor);
+
+// High 64 bits of 64x64 product
+static inline u64 insane_mulhi(u64 a, u64 b)
+{
+#ifdef __SIZEOF_INT128__
+	return (u64)(((unsigned __int128)a * b) >> 64);
+#else
+	u64 a_lo = (u32)a, a_hi = a >> 32;
+	u64 b_lo = (u32)b, b_hi = b >> 32;
+	u64 lo_lo = a_lo * b_lo;
+	u64 hi_lo = a_hi * b_lo;
+	u64 lo_hi = a_lo * b_hi;
+	u64 cross = (lo_lo >> 32) + (u32)hi_lo + lo_hi;
+
+	return (hi_lo >> 32) + (cross >> 32) + a_hi * b_hi;
+#endif
+}
+
+static inline u32 __insane_div(u64 *n, const struct insane_divisor *div)
+{
+	u64 q, t;
+
+	if (!div->magic) {
+		q = *n >> div->shift;
+	} else {
+		t = insane_mulhi(*n, div->magic);
+		q = (t + ((*n - t) >> 1)) >> div->shift;
+	}
+
+	t = *n - q * div->divisor;
+	*n = q;
+	return (u32)t;
+}
+
+// Same contract as sector_div(): n becomes quotient, remainder is returned.
+#define insane_div(n, div) ({ \
+	u64 __n = (n); \
+	u32 __r = __insane_div(&__n, (div)); \
+	(n) = __n; \
+	__r; \
+})
+
+// Remainder only, n is left intact.
+static inline u32 insane_mod(u64 n, const struct insane_divisor *div)
+{
+	return __insane_div(&n, div);
+}
+
 // Backend device
 struct insane_dev 
 {
 	struct dm_dev *dev;
 	atomic_t error_count;
+
+	// Emulated parity and rebuild I/O in flight, see max_inflight
+	atomic_t inflight;
+	atomic_t inflight_bytes;
 };
 
+// Lock of virtual stripes hashed to it. Read-modify-write of real parity
+// (compute) or of ordered_rmw holds it from reads until syndromes are
+// written, so writes sharing syndromes don't interleave. Uncontended lock
+// is taken and released by one atomic operation. Contended write isn't
+// waited for in map (its own reads may be still queued by
+// generic_make_request): it is queued here and resumed by releaser.
+#define INSANE_STRIPE_LOCKS_SHIFT 8
+#define INSANE_STRIPE_LOCKS (1 << INSANE_STRIPE_LOCKS_SHIFT)
+struct insane_lock
+{
+	atomic_t        count;   // Holder and waiters, 0 - free
+	spinlock_t      lock;    // Protects waiting and handoff
+	bool            handoff; // Released before waiter was queued
+	struct bio_list waiting; // Frontend bios of waiting writes
+} ____cacheline_aligned_in_smp;
+
 // insane context
 // Each mapped device(frontend device) has it's own context.
 struct insane_c 
@@ -34,7 +122,6 @@ struct insane_c
 	sector_t dev_width; 
 
 	int ndev;
-	int ndev_shift;
 
 	int chunk_size;
 	int chunk_size_bytes;
@@ -44,39 +131,251 @@ struct insane_c
 	int io_pattern;
         int recovering_disk;
 
+	// Reciprocals of ndev, algorithm stripe_blocks and data blocks
+	// per stripe (stripe_blocks - p_blocks - e_blocks).
+	struct insane_divisor ndev_div;
+	struct insane_divisor stripe_div;
+	struct insane_divisor data_div;
+	struct insane_divisor group_div;
+
 	// RAID algorithm descriptor
 	struct insane_algorithm *alg;
 
+	// Algorithm geometry of this context. Copied from descriptor
+	// and may be changed by configure (e.g. depends on ndev).
+	unsigned int stripe_blocks;
+	unsigned int p_blocks;
+	unsigned int e_blocks;
+
+	// Data blocks of one parity group (blocks sharing syndromes), the
+	// virtual stripe of streams, stripe cache and stripe locks. Defaults to
+	// stripe_blocks - p_blocks - e_blocks, configure sets it when parity
+	// rows differ from algorithm stripe.
+	unsigned int group_blocks;
+
+	// Algorithm runtime data, owned by algorithm (see configure/destroy)
+	void *alg_data;
+
+	// Algorithm arguments from table (<name>:<args>) or NULL.
+	// Valid only during configure.
+	const char *alg_args;
+
 	struct work_struct trigger_event;
 
+	// Pools of emulated parity and rebuild I/O and its in-flight count
+	struct bio_set *bs;
+	mempool_t *page_pool;
+	struct mutex page_lock; // Waiter for pages of whole compute write
+	mempool_t *io_pool; // struct insane_io
+	mempool_t *pq_pool; // struct insane_pq of compute mode, or NULL
+	struct workqueue_struct *wq;
+	atomic_t io_pending;
+	wait_queue_head_t io_wait;
+	wait_queue_head_t throttle_wait; // Member in-flight limit is hit
+
+	// Write streams of adaptive io_pattern, INSANE_STREAMS of them
+	struct insane_stream *streams;
+	spinlock_t stream_lock;
+	struct delayed_work stream_work; // Flush of stale partial stripes
+
+	// Write-back stripe cache (stripe_cache), nr_stripes entries
+	struct insane_stripe *stripes;
+	unsigned int nr_stripes;
+	struct hlist_head *stripe_hash;  // By virtual stripe number
+	unsigned int stripe_hash_bits;
+	struct list_head stripe_lru;     // Free entries first, then dirty by age. Flushed
+	                                 // entries are off the list.
+	spinlock_t stripe_lock;
+	struct delayed_work stripe_work; // Flush of idle dirty stripes
+
+	// Dirty bitmaps of virtual stripe data (stripe cache, streams)
+	unsigned int stripe_unit_shift;  // Sectors in bitmap unit
+	unsigned int stripe_units;       // Units in data of virtual stripe
+
+	// Per data block of parity group: blocks covered by its syndromes,
+	// group_blocks bitmaps (NULL for P+Q, they cover the whole group)
+	unsigned long *group_cover;
+
+	// Parity updates by method, status INFO
+	atomic64_t full_writes;          // Full stripe, nothing read
+	atomic64_t rcw_writes;           // Reconstruct-write, clean data read
+	atomic64_t rmw_writes;           // Read-modify-write
+
+#ifdef INSANE_DEFER_PARITY
+	// Deferred parity submission (defer_parity), see insane_defer
+	struct insane_cpu __percpu *cpu;
+	mempool_t *defer_pool; // struct insane_defer
+#endif
+
+	// Stripe lock table, hashed by virtual stripe
+	struct insane_lock locks[INSANE_STRIPE_LOCKS];
+
 	// This field should always be the last in this structure
 	struct insane_dev devs[0]; // Homo style
 };
 
+// Translate block position counted over all devices in lane order
+// (lane_pos = lane * ndev + device) to device and chunk start sector.
+static inline void insane_lane_place(struct insane_c *ctx, u64 lane_pos, int *device_number, sector_t *sector)
+{
+	*device_number = insane_div(lane_pos, &ctx->ndev_div);
+	*sector = lane_pos << ctx->chunk_size_shift;
+}
+
 const char *io_patterns[] = 
 {
 	"sequential",
 	"random",
-        "recover"
+        "recover",
+	"adaptive"
 };
 
 enum {
 	SEQUENTIAL = 0, 
 	RANDOM,
 	RECOVER,
+	ADAPTIVE, // Sequential or random by write stream
 	IO_PATTERN_NUM
 };
 
-#define MAX_SYNDROMES 64
+// Syndromes of mapped block.
+// Descriptor is owned by the caller and filled by algorithm map callback.
+#define MAX_SYNDROMES 16
 struct parity_places 
 {
-	int       device_number[MAX_SYNDROMES];
-	sector_t  sector_number[MAX_SYNDROMES];
+	int       count;        // Valid entries in device_number/sector_number
+	bool      last_block;
 	int       start_device; // First device in current stripe
 	sector_t  start_sector; // First block sector in current stripe
-	bool      last_block;
+	int       device_number[MAX_SYNDROMES];
+	sector_t  sector_number[MAX_SYNDROMES]; // Syndrome chunk start
+
+	// P+Q algorithms (pq set in descriptor): position of block among
+	// data_count data blocks of its stripe, for Q coefficient
+	int       data_index;
+	int       data_count;
+
+	// GF(2^8) algorithms (gf set in descriptor): coefficient of block in
+	// each syndrome, 1 for XOR syndrome, 0 if syndrome doesn't cover block
+	u8        coef[MAX_SYNDROMES];
+};
+
+// Write stream of adaptive io_pattern. Parity of sequential run is
+// accumulated and written once its stripe is complete.
+#define INSANE_STREAMS 8
+struct insane_stream
+{
+	bool          active;
+	sector_t      start; // Frontend range accumulated in current stripe
+	sector_t      next;  // Expected sector of next write of stream
+	sector_t      end;   // End of current stripe
+	unsigned long last;  // jiffies of last write
+	bool          flushing; // Partial stripe is flushed, writers skip stream
+	struct parity_places syndromes; // Union of accumulated writes syndromes
+};
+
+// Entry of write-back stripe cache. Data of random write goes to member
+// at once, its parity update is postponed: dirty units of stripe are
+// collected until stripe is complete (parity is written without reads)
+// or evicted / idle for cache_timeout (one parity update of dirty units,
+// see insane_stripe_parity). Unit is a page or larger, so bitmap has
+// fixed size.
+#define INSANE_STRIPE_UNITS 1024
+struct insane_stripe
+{
+	struct hlist_node hash;   // Unhashed while entry is free or flushed
+	struct list_head  lru;
+	u64           number;     // Virtual stripe
+	unsigned long last;       // jiffies of last write
+	unsigned int  dirty_count;
+	struct parity_places syndromes; // Union of syndromes of dirty units
+	DECLARE_BITMAP(dirty, INSANE_STRIPE_UNITS);
+};
+
+// Stages of frontend write
+enum {
+	INSANE_IO_READ,  // Ordered RMW reads old data and syndromes
+	INSANE_IO_WRITE, // Data and syndromes are written
+};
+
+// Frontend write waiting for its emulated parity I/O (wait_parity and
+// ordered_rmw modes). Bio completion is hooked and restored when pending
+// drops to zero in INSANE_IO_WRITE stage.
+struct insane_io
+{
+	struct insane_c *sc;
+	struct bio      *bio;
+	atomic_t        pending; // Frontend bio itself and parity bios
+	int             error;
+	int             stage;
+
+	bio_end_io_t    *bi_end_io;
+	void            *bi_private;
+
+	// Ordered RMW: syndromes to write and work to write them
+	struct parity_places syndromes;
+	struct work_struct   work;
+
+	// Compute mode: buffers of real P+Q update or NULL
+	struct insane_pq     *pq;
+
+	// Stripe lock held by write or NULL, member of its data
+	struct insane_lock   *lock;
+	int                  device;
+	sector_t             sector; // Frontend, selects stripe lock
 };
 
+// Compute mode buffers of one write, nr_pages pages each:
+// old data (becomes delta), nr_syndromes syndromes (P and Q for pq
+// algorithms), then two scratch pages and pointers for gen_syndrome
+// or insane_gf_update.
+struct insane_pq
+{
+	unsigned int nr_pages;
+	unsigned int nr_syndromes;
+	struct page  **pages;
+	void         **ptrs;
+};
+
+// Front pad of emulated and rebuild bios
+struct insane_bio_info
+{
+	struct insane_c  *sc;
+	struct insane_io *io; // Frontend write waiting for bio or NULL
+	struct insane_dev *dev;
+	unsigned int     bytes; // Accounted in dev in-flight
+};
+
+#ifdef INSANE_DEFER_PARITY
+// Kinds of deferred parity work
+enum {
+	INSANE_DEFER_FULL, // Sequential: write whole syndrome chunks
+	INSANE_DEFER_RMW,  // Random: read old data, read and write syndromes
+	INSANE_DEFER_READ, // Ordered RMW: reads only, writes are staged by io
+};
+
+// Parity work of one mapped write, queued by insane_map and submitted
+// by worker of the CPU it was queued on.
+struct insane_defer
+{
+	struct llist_node    node;
+	struct insane_io     *io; // Holds reference of waiting write or NULL
+	int                  kind;
+	int                  device; // Data member and range (RMW)
+	sector_t             sector;
+	unsigned int         size;
+	struct parity_places syndromes;
+};
+
+// Per-CPU queue of deferred parity work
+struct insane_cpu
+{
+	struct insane_c    *sc;
+	struct llist_head  list;
+	struct work_struct work;
+};
+#endif
+
 #define MAX_LENGTH 24 // timely
 struct recover_stripe
 {
@@ -92,14 +391,34 @@ struct recover_stripe
 struct insane_algorithm 
 {
 	char name[ALG_NAME_LEN];
-	unsigned int ndisks;
+
+	// Geometry defaults, copied to context on construction.
+	// Descriptor is shared by all devices, so it's never changed at runtime.
 	unsigned int stripe_blocks;
 	unsigned int p_blocks; // Parity blocks count
 	unsigned int e_blocks; // Empty blocks count
 
-	struct parity_places (*map)(struct insane_c *ctx, u64 block, sector_t *sector, int *device_number);
+	// Remap block. Syndromes are filled only if parity is not NULL
+	// (it is NULL for READ bios).
+	void (*map)(struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity);
+	// Prepare context of new device: set geometry in ctx and allocate
+	// ctx->alg_data. destroy frees what configure allocated.
 	int (*configure)(struct insane_c *ctx);
+	void (*destroy)(struct insane_c *ctx);
         struct recover_stripe (*recover)(struct insane_c *ctx, u64 block, int device_number);
+	// Optional batched variants, used by core when set.
+	// map_range maps count consecutive chunks starting from chunk
+	// (block * ndev + device_number) to chunk start sectors, without syndromes
+	// (data chunks of virtual stripe read by reconstruct-write).
+	// recover_range fills result[count] for consecutive blocks of one device.
+	void (*map_range)(struct insane_c *ctx, u64 chunk, unsigned int count, sector_t *sector, int *device_number);
+	void (*recover_range)(struct insane_c *ctx, u64 block, int device_number, unsigned int count, struct recover_stripe *result);
+	// Syndromes are RAID-6 P and Q, map sets data_index and data_count.
+	// Such algorithms may compute real parity (compute parameter).
+	bool pq;
+	// Syndromes are linear over GF(2^8), map sets coef of block in each
+	// of them. Such algorithms may compute real parity too.
+	bool gf;
 	struct module *module;
 	struct list_head list;
 };
@@ -107,4 +426,25 @@ struct insane_algorithm
 int insane_register(struct insane_algorithm *alg);
 int insane_unregister(struct insane_algorithm *alg);
 
+// GF(2^8) Reed-Solomon engine, insane_gf module.
+// Systematic Cauchy code of k data blocks and m syndromes:
+// syndrome j is sum of matrix[j * k + i] * data[i]. Any m lost blocks
+// are recoverable, k + m <= 256.
+struct insane_gf_code
+{
+	int k;
+	int m;
+	u8  matrix[0];
+};
+
+struct insane_gf_code *insane_gf_code_create(int k, int m);
+void insane_gf_code_free(struct insane_gf_code *code);
+// syndromes[j] = sum of code coefficients * data[i], len bytes of each
+void insane_gf_encode(struct insane_gf_code *code, size_t len, void **data, void **syndromes);
+// Delta update (RMW): dst[j] ^= coef[j] * src
+void insane_gf_update(int count, const u8 *coef, size_t len, void **dst, const void *src);
+// Rebuild erased blocks in place, blocks are data then syndromes.
+// Only self-test calls it: rebuild I/O is emulated.
+int insane_gf_decode(struct insane_gf_code *code, size_t len, void **blocks, const int *erased, int count);
+
 #endif // INSANE_H
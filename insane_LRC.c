@@ -4,10 +4,14 @@
 
 #include "lrc_config.c"
 
-static struct parity_places algorithm_lrc( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number );
-static int lrc_configure( struct insane_c *ctx );
+static void algorithm_lrc( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity );
 
+static int lrc_configure( struct insane_c *ctx );
+static void lrc_destroy( struct insane_c *ctx );
 static struct recover_stripe recover_lrc(struct insane_c *ctx, u64 block, int device_number);
+static void algorithm_lrc_range( struct insane_c *ctx, u64 chunk, unsigned int count, sector_t *sector, int *device_number );
+static void recover_lrc_range(struct insane_c *ctx, u64 block, int device_number,
+			      unsigned int count, struct recover_stripe *result);
 
 struct insane_algorithm lrc_alg = {
 	.name       = "lrc",
@@ -16,164 +20,122 @@ struct insane_algorithm lrc_alg = {
 	.stripe_blocks = (SUBSTRIPE_DATA + 1) * SUBSTRIPES + E_BLOCKS + GLOBAL_S,
 	.map        = algorithm_lrc,
         .recover    = recover_lrc,
+	.map_range  = algorithm_lrc_range,
+	.recover_range = recover_lrc_range,
 	.configure  = lrc_configure,
+	.destroy    = lrc_destroy,
+	.gf         = true,
     	.module     = THIS_MODULE
 };
 
+// Placement of n-th data block of virtual stripe
+struct lrc_slot
+{
+	u16 slot; // Position in virtual stripe
+	u16 ls;   // Position of its local syndrome
+};
+
+// Longest scheme: every data block must fit in struct recover_stripe
+#define LRC_MAX_BLOCKS (MAX_LENGTH + MAX_SYNDROMES + 1)
+
+// Per-device scheme tables, ctx->alg_data.
+// Built once in configure, so map is a couple of lookups
+// regardless of groups and syndromes count.
+struct lrc_data
+{
+	int ls_count;
+	int gs_count;
+	u16 ls[MAX_SYNDROMES];  // Local syndromes positions, by group
+	u16 gs[MAX_SYNDROMES];  // Global syndromes positions
+	u16 eb;                 // Empty block position
+	struct insane_gf_code *code; // Global syndromes, NULL without them
+	unsigned char scheme[LRC_MAX_BLOCKS]; // Scheme in hex form
+	struct lrc_slot slot[0]; // Indexed by vs_position
+};
+
 /*
  * LRC RAID algorithm
  */
-static struct parity_places algorithm_lrc( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number )
+static void algorithm_lrc( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity )
 {
-	struct parity_places parity;
-	
-	u64 virtual_stripe;	
-	u64 vs_position;
-	u64 data_block, lane_pos;
-	u64 global_gap, local_gap;
-	u64 last_block;
-
-	sector_t local_parity, global_parity;
-	int block_size;
-	int total_disks;
-	int i,j;
-        unsigned char group;
+	struct lrc_data *data = ctx->alg_data;
+	struct lrc_slot *place;
 
-	block_size = ctx->chunk_size;
-	total_disks = lrc_alg.ndisks;
+	u64 virtual_stripe, stripe_start;
+	u64 vs_position;
+	sector_t block_offset;
+	int i, j;
 
         // number of data block (block in raid which is not empty or syndrome)
-	data_block = *device_number + block * total_disks;
+	virtual_stripe = *device_number + block * ctx->ndev;
 
-	/*
-	 * Let's get position of block in VS.
-	 * SUBSTRIPE_DATA - quantity of data blocks in substripe;
-	 * SUBSTRIPES - quantity of substripes in VS;
-	 */
-	
-	virtual_stripe = data_block;
-	vs_position = sector_div(virtual_stripe, (SUBSTRIPE_DATA * SUBSTRIPES)); 
 	// virtual_stripe  	- number of vs.
 	// vs_position 		- offset in vs without counting parity.
+	vs_position = insane_div(virtual_stripe, &ctx->data_div);
+	place = &data->slot[vs_position];
 
-	// Now let's get positions of syndromes.
-        group = lrc_data[vs_position];
-        local_parity = lrc_ls[group];
-	local_parity = (virtual_stripe * lrc_alg.stripe_blocks) + local_parity;
-	//global_parity = virtual_stripe * lrc_alg.stripe_blocks + lrc_gs;
-	
-	// Parity in sequential	mode
+	stripe_start = virtual_stripe * ctx->stripe_blocks;
+
+	block_offset = *sector & (ctx->chunk_size - 1);
+	insane_lane_place(ctx, stripe_start + place->slot, device_number, sector);
+	*sector += block_offset;
+
+	if (!parity)
+		return;
+
+	insane_lane_place(ctx, stripe_start, &parity->start_device, &parity->start_sector);
+
+	// Parity in sequential	mode: all syndromes of stripe
 	if (ctx->io_pattern == SEQUENTIAL)
 	{
-		parity.start_sector = virtual_stripe * lrc_alg.stripe_blocks;
-		parity.start_device = sector_div(parity.start_sector, total_disks);
-		parity.start_sector = parity.start_sector * block_size;
-
-		for (i = 0; i < SUBSTRIPES; i++) {
-                        // local syndromes
-			parity.device_number[i] = (parity.start_device + lrc_ls[i]) % ctx->ndev;
-			if (parity.device_number[i] < parity.start_device) {
-				parity.sector_number[i] = parity.start_sector + ctx->chunk_size;
-			} else {
-				parity.sector_number[i] = parity.start_sector;
-			}
+		for (i = 0; i < data->ls_count; i++) {
+			insane_lane_place(ctx, stripe_start + data->ls[i],
+					  &parity->device_number[i], &parity->sector_number[i]);
+			parity->coef[i] = (data->ls[i] == place->ls);
 		}
-                // global syndromes
-                for (j = 0; i < SUBSTRIPES + GLOBAL_S; i++) {
-    		    parity.device_number[i] = (parity.start_device + lrc_gs[j]) % ctx->ndev;
-
-		    if (parity.device_number[i] < parity.start_device) {
-			parity.sector_number[i] = parity.start_sector + ctx->chunk_size;
-        	    } else {
-	    		parity.sector_number[i] = parity.start_sector;
-	            }
-                    
-                    j++;
-                }
-                // breakpoint
-		parity.device_number[i] = -1;
-	
-		last_block = parity.start_device + lrc_ldb;
-		i = sector_div(last_block, total_disks);
-		last_block = i;
 	}
-	// Parity in random mode
-	else {	
-		parity.device_number[0] = sector_div(local_parity, total_disks);
-		parity.sector_number[0] = local_parity * block_size;
-
-                for (i = 0; i < GLOBAL_S; i++) {
-                    global_parity = virtual_stripe * lrc_alg.stripe_blocks + lrc_gs[i];
-                    parity.device_number[i+1] = sector_div(global_parity, total_disks);
-                    parity.sector_number[i+1] = global_parity * block_size;    
-                }
-
-	        //breakpoint
-                parity.device_number[i+1] = -1;
-
-		parity.start_sector = virtual_stripe * lrc_alg.stripe_blocks;
-		parity.start_device = sector_div(parity.start_sector, total_disks);
-		parity.start_sector = parity.start_sector * block_size;
+	// Parity in random mode: local syndrome of block group
+	else {
+		insane_lane_place(ctx, stripe_start + place->ls,
+				  &parity->device_number[0], &parity->sector_number[0]);
+		parity->coef[0] = 1;
+		i = 1;
 	}
 
-	// Okay, let's return to counting position of data block
-	// now we can calculate global_gap...
-	global_gap = virtual_stripe * (SUBSTRIPES + E_BLOCKS + GLOBAL_S);
-	
-	// ...and local_gap
-	local_gap = vs_position;
-        i = 0;
-        while (i < SUBSTRIPES + E_BLOCKS + GLOBAL_S) {
-            if (local_gap >= lrc_offset[i]) {
-                local_gap++;
-            }
-            i++;
-        }
-
-	// Almost ready.
-	lane_pos = data_block + global_gap + local_gap - vs_position;
-	/*
-	 * Finally, we can get new device_number and sector number from lane_pos.
-	 */
+	// global syndromes
+	for (j = 0; j < data->gs_count; j++, i++) {
+		insane_lane_place(ctx, stripe_start + data->gs[j],
+				  &parity->device_number[i], &parity->sector_number[i]);
+		parity->coef[i] = data->code->matrix[j * data->code->k + vs_position];
+	}
 
-	*device_number = sector_div(lane_pos, total_disks);
+	parity->count = i;
 
-	parity.last_block = false;
+	// Data blocks are written in vs_position order
+	parity->last_block = false;
 	if (ctx->io_pattern == SEQUENTIAL)
-	{
-	    if (*device_number == last_block)
-		parity.last_block = true;
-	}
-	
-	i = sector_div(*sector, block_size);
-	*sector = lane_pos * block_size + i;
-        
-
-	return parity;
+		parity->last_block = (vs_position == ctx->stripe_blocks - ctx->p_blocks - ctx->e_blocks - 1);
 }
 
+// Recover one block, its stripe and position in stripe are already known
+static void lrc_recover_block(struct insane_c *ctx, u64 stripe_number, int block_in_stripe,
+			      u64 block, int device_number, struct recover_stripe *result) {
+    struct lrc_data *data = ctx->alg_data;
 
-static struct recover_stripe recover_lrc(struct insane_c *ctx, u64 block, int device_number) {
-    struct recover_stripe result;
-
-    int total_disks, i, j, block_in_stripe;
-    u64 chunk_size, stripe_number, sector, substripe_number, empty_device;
+    int total_disks, i, j;
+    u64 chunk_size, sector, substripe_number, empty_device;
 
     bool gs;
 
     unsigned char pattern;
 
-    total_disks = lrc_alg.ndisks;
+    total_disks = ctx->ndev;
     chunk_size = ctx->chunk_size;
 
-    // calculating stripe number
-    stripe_number = block * total_disks + device_number;
-    block_in_stripe = sector_div(stripe_number, lrc_alg.stripe_blocks);
-
     // GLOBAL SYNDROME case
     gs = false;
-    for (i = 0; i < GLOBAL_S; i++) {
-        if (block_in_stripe == lrc_gs[i]) {
+    for (i = 0; i < data->gs_count; i++) {
+        if (block_in_stripe == data->gs[i]) {
             gs = true;
             break;
         }
@@ -182,78 +144,284 @@ static struct recover_stripe recover_lrc(struct insane_c *ctx, u64 block, int de
     if (gs) {
         substripe_number = 0;
         j = 0;
-        for (i = 0; i < lrc_alg.stripe_blocks; i++) {
-            if (lrc_scheme[i] < 16) {
+        for (i = 0; i < ctx->stripe_blocks; i++) {
+            if (data->scheme[i] < 0xc0) {
                 // calculating read parameteres
-                sector = stripe_number * lrc_alg.stripe_blocks + i; 
-                result.read_device[j] = sector_div(sector, total_disks);
-                result.read_sector[j] = sector * chunk_size;
+                sector = stripe_number * ctx->stripe_blocks + i; 
+                result->read_device[j] = sector_div(sector, total_disks);
+                result->read_sector[j] = sector * chunk_size;
                 j++;
             }
         }
 
-        result.quantity = lrc_alg.stripe_blocks - GLOBAL_S - SUBSTRIPES - E_BLOCKS;
+        result->quantity = j;
         
-        result.write_device = device_number - block_in_stripe + lrc_eb;
-        result.write_sector = block * chunk_size;
+        result->write_device = device_number - block_in_stripe + data->eb;
+        result->write_sector = block * chunk_size;
         
         // it is possible to comment this clause, if you have checked your scheme
-        if (result.write_device < 0) {
-            result.write_device += total_disks;
-            result.write_sector -= chunk_size;
+        if (result->write_device < 0) {
+            result->write_device += total_disks;
+            result->write_sector -= chunk_size;
         }
 	
-        return result;
+        return;
 
     }
 
     // EMPTY BLOCK case
-    if (block_in_stripe == lrc_eb) {
-        result.quantity = 0;
-        result.write_device = -1;
+    if (block_in_stripe == data->eb) {
+        result->quantity = 0;
+        result->write_device = -1;
 
-        return result;
+        return;
     }
 
     // other cases
 
     // calculating substripe number
-    substripe_number = lrc_scheme[block_in_stripe] | 0xc0; // local syndrome of substripe
+    substripe_number = data->scheme[block_in_stripe] | 0xc0; // local syndrome of substripe
 
     j = 0;
 
-    for (i = 0; i < lrc_alg.stripe_blocks; i++) {
-        pattern = lrc_scheme[i] | 0xc0; // now pattern can be local syndrome of group, global syndrome or empty block.
+    for (i = 0; i < ctx->stripe_blocks; i++) {
+        pattern = data->scheme[i] | 0xc0; // now pattern can be local syndrome of group, global syndrome or empty block.
         
         if ((pattern == substripe_number) && (i != block_in_stripe)) {
-            sector = stripe_number * lrc_alg.stripe_blocks + i;
-            result.read_device[j] = sector_div(sector, total_disks);
-            result.read_sector[j] = sector * chunk_size;
+            sector = stripe_number * ctx->stripe_blocks + i;
+            result->read_device[j] = sector_div(sector, total_disks);
+            result->read_sector[j] = sector * chunk_size;
             j++;
         }
     }
 
-    empty_device = device_number - block_in_stripe + lrc_eb + total_disks; // device with empty block
+    empty_device = device_number - block_in_stripe + data->eb + total_disks; // device with empty block
 
-    result.write_device = sector_div(empty_device, total_disks);
+    result->write_device = sector_div(empty_device, total_disks);
 
     if (i < device_number)  // empty block is on the next lane
-        result.write_sector = (block + 1) * chunk_size;
+        result->write_sector = (block + 1) * chunk_size;
     else                    // empty block in on the current lane
-        result.write_sector = block * chunk_size;
+        result->write_sector = block * chunk_size;
 	
-    result.quantity = SUBSTRIPE_DATA;
-        
+    result->quantity = j;
+}
+
+static struct recover_stripe recover_lrc(struct insane_c *ctx, u64 block, int device_number) {
+    struct recover_stripe result;
+    u64 stripe_number;
+    int block_in_stripe;
+
+    // calculating stripe number
+    stripe_number = block * ctx->ndev + device_number;
+    block_in_stripe = insane_div(stripe_number, &ctx->stripe_div);
+
+    lrc_recover_block(ctx, stripe_number, block_in_stripe, block, device_number, &result);
     return result;
 }
 
+// Next block of device is ndev blocks further in lane order,
+// so stripe position is advanced without division.
+static void recover_lrc_range(struct insane_c *ctx, u64 block, int device_number,
+			      unsigned int count, struct recover_stripe *result) {
+    u64 stripe_number;
+    unsigned int i, block_in_stripe;
+
+    stripe_number = block * ctx->ndev + device_number;
+    block_in_stripe = insane_div(stripe_number, &ctx->stripe_div);
+
+    for (i = 0; i < count; i++) {
+        lrc_recover_block(ctx, stripe_number, block_in_stripe, block + i, device_number, &result[i]);
+
+        block_in_stripe += ctx->ndev;
+        while (block_in_stripe >= ctx->stripe_blocks) {
+            block_in_stripe -= ctx->stripe_blocks;
+            stripe_number++;
+        }
+    }
+}
+
+// Consecutive chunks are consecutive data slots of virtual stripes
+static void algorithm_lrc_range( struct insane_c *ctx, u64 chunk, unsigned int count, sector_t *sector, int *device_number )
+{
+	struct lrc_data *data = ctx->alg_data;
+	u64 stripe_start;
+	unsigned int i, vs_position, data_blocks;
+
+	data_blocks = ctx->stripe_blocks - ctx->p_blocks - ctx->e_blocks;
+	vs_position = insane_div(chunk, &ctx->data_div);
+	stripe_start = chunk * ctx->stripe_blocks;
+
+	for (i = 0; i < count; i++) {
+		insane_lane_place(ctx, stripe_start + data->slot[vs_position].slot,
+				  &device_number[i], &sector[i]);
+
+		if (++vs_position == data_blocks) {
+			vs_position = 0;
+			stripe_start += ctx->stripe_blocks;
+		}
+	}
+}
+
+// Translate scheme string from table to hex form:
+//   1..9 - data block of group, s<N>/S<N> - local syndrome of group N,
+//   e/E - empty block, g/G - global syndrome.
+// Returns scheme length.
+static int lrc_parse( const char *str, unsigned char *scheme )
+{
+	int i;
+
+	for (i = 0; *str; str++, i++) {
+		if (i == LRC_MAX_BLOCKS)
+			return -EINVAL;
+
+		switch (*str) {
+		case '1' ... '9':
+			scheme[i] = *str - '1';
+			break;
+		case 's':
+		case 'S':
+			str++;
+			if (*str < '1' || *str > '9')
+				return -EINVAL;
+			scheme[i] = 0xc0 + (*str - '1');
+			break;
+		case 'e':
+		case 'E':
+			scheme[i] = 0xee;
+			break;
+		case 'g':
+		case 'G':
+			scheme[i] = 0xff;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return i;
+}
+
+// Build per-device tables from scheme in hex form
+// (data block - group number, 0xc0 + group - local syndrome,
+// 0xee - empty block, 0xff - global syndrome).
+static int lrc_build( struct insane_c *ctx, const unsigned char *scheme, int length )
+{
+	struct lrc_data *data;
+	u16 ls[MAX_SYNDROMES], gs[MAX_SYNDROMES];
+	int data_blocks, groups, gs_count, empty, eb;
+	int i, n;
+
+	if (length > LRC_MAX_BLOCKS)
+		return -EINVAL;
+
+	for (i = 0; i < MAX_SYNDROMES; i++)
+		ls[i] = length; // not found yet
+
+	// Count blocks and find syndromes
+	groups = 0;
+	gs_count = 0;
+	empty = 0;
+	eb = 0;
+	data_blocks = 0;
+	for (i = 0; i < length; i++) {
+		if (scheme[i] < 0xc0) {
+			data_blocks++;
+		} else if (scheme[i] == 0xee) {
+			empty++;
+			eb = i;
+		} else if (scheme[i] == 0xff) {
+			if (gs_count == MAX_SYNDROMES)
+				return -EINVAL;
+			gs[gs_count++] = i;
+		} else {
+			n = scheme[i] - 0xc0;
+			if (n >= MAX_SYNDROMES || ls[n] != length)
+				return -EINVAL;
+			ls[n] = i;
+			groups++;
+		}
+	}
+
+	if (!data_blocks || data_blocks > MAX_LENGTH || empty != 1 ||
+	    groups + gs_count > MAX_SYNDROMES)
+		return -EINVAL;
+
+	// Groups are numbered from 0 and each one has its local syndrome
+	for (i = 0; i < groups; i++) {
+		if (ls[i] == length)
+			return -EINVAL;
+	}
+	for (i = 0; i < length; i++) {
+		if (scheme[i] < 0xc0 && scheme[i] >= groups)
+			return -EINVAL;
+	}
+
+	data = kmalloc(sizeof(*data) + sizeof(data->slot[0]) * data_blocks, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	data->ls_count = groups;
+	data->gs_count = gs_count;
+	memcpy(data->ls, ls, sizeof(ls));
+	memcpy(data->gs, gs, sizeof(gs));
+	data->eb = eb;
+	memcpy(data->scheme, scheme, length);
+
+	// Local syndromes are XOR of group, global ones are Cauchy code
+	// of all data blocks
+	data->code = NULL;
+	if (gs_count) {
+		data->code = insane_gf_code_create(data_blocks, gs_count);
+		if (!data->code) {
+			kfree(data);
+			return -ENOMEM;
+		}
+	}
+
+	for (i = 0, n = 0; i < length; i++) {
+		if (scheme[i] >= 0xc0)
+			continue;
+
+		data->slot[n].slot = i;
+		data->slot[n].ls = ls[scheme[i]];
+		n++;
+	}
+
+	ctx->stripe_blocks = length;
+	ctx->p_blocks = groups + gs_count;
+	ctx->e_blocks = empty;
+	ctx->alg_data = data;
+	return 0;
+}
+
+// Scheme comes from the table as "lrc:<scheme>",
+// compiled lrc_config.c scheme is used without it.
 static int lrc_configure( struct insane_c *ctx )
 {
+	unsigned char scheme[LRC_MAX_BLOCKS];
+	int length, r;
+
 	if (!ctx)
 		return -EINVAL;
 
-	lrc_alg.ndisks = ctx->ndev;
-	return 0;
+	if (!ctx->alg_args)
+		return lrc_build(ctx, lrc_scheme, sizeof(lrc_scheme));
+
+	length = lrc_parse(ctx->alg_args, scheme);
+	r = length < 0 ? length : lrc_build(ctx, scheme, length);
+	if (r)
+		dm_log("Invalid LRC scheme %s\n", ctx->alg_args);
+
+	return r;
+}
+
+static void lrc_destroy( struct insane_c *ctx )
+{
+	struct lrc_data *data = ctx->alg_data;
+
+	insane_gf_code_free(data->code);
+	kfree(ctx->alg_data);
 }
 
 static int __init insane_lrc_init( void )
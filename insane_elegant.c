@@ -2,8 +2,7 @@
 #include <linux/slab.h>
 #include "insane.h"
 
-static struct parity_places algorithm_elegant( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number );
-static int elegant_configure( struct insane_c *ctx );
+static void algorithm_elegant( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity );
 
 static struct recover_stripe recover_from_stripe_to_empty(struct insane_c *ctx, u64 block, int device_number);
 static struct recover_stripe recover_from_empty_to_new(struct insane_c *ctx, u64 block, int device_number);
@@ -20,17 +19,14 @@ struct insane_algorithm elegant_alg = {
 	.stripe_blocks = (SUBSTRIPE_DATA + 1) * SUBSTRIPES + E_BLOCKS + 1,
 	.map        = algorithm_elegant,
         .recover    = recover_from_stripe_to_empty,
-	.configure  = elegant_configure,
     	.module     = THIS_MODULE
 };
 
 /*
  * Elegant RAID algorithm
  */
-static struct parity_places algorithm_elegant( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number )
+static void algorithm_elegant( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity )
 {
-	struct parity_places parity;
-	
 	u64 virtual_stripe;	
 	u64 vs_position;
 	u64 data_block, lane_pos;
@@ -43,7 +39,7 @@ static struct parity_places algorithm_elegant( struct insane_c *ctx, u64 block,
 	int i;
 	
 	block_size = ctx->chunk_size;
-	total_disks = elegant_alg.ndisks;
+	total_disks = ctx->ndev;
 
 	data_block = *device_number + block * total_disks;
 	//dm_log("data_block: %lld\n", data_block);
@@ -54,87 +50,87 @@ static struct parity_places algorithm_elegant( struct insane_c *ctx, u64 block,
 	 */
 	
 	virtual_stripe = data_block;
-	vs_position = sector_div(virtual_stripe, (SUBSTRIPE_DATA * SUBSTRIPES)); 
+	vs_position = insane_div(virtual_stripe, &ctx->data_div);
 	// virtual_stripe  	- number of vs.
 	// vs_position 		- offset in vs without counting parity.
 
+	// Let's count position of data block
+	// now we can calculate global_gap...
+	global_gap = virtual_stripe * (SUBSTRIPES + ctx->e_blocks + 1);
+	
+	// ...and local_gap
+	local_gap = vs_position;	
+	sector_div(local_gap, SUBSTRIPE_DATA);
+
+	// Almost ready.
+	lane_pos = data_block + global_gap + local_gap;
+	
+	/*
+	 * Finally, we can get new device_number and sector number from lane_pos.
+	 */
+
+	*device_number = insane_div(lane_pos, &ctx->ndev_div);
+
+	i = *sector & (block_size - 1);
+	*sector = (lane_pos << ctx->chunk_size_shift) + i;
+
+	if (!parity)
+		return;
+
 	// Now let's count positions of syndromes.
 	local_parity = vs_position;
 	sector_div(local_parity, SUBSTRIPE_DATA);
-	local_parity = (virtual_stripe * elegant_alg.stripe_blocks) + (local_parity + 1) * (SUBSTRIPE_DATA + 1) - 1;
+	local_parity = (virtual_stripe * ctx->stripe_blocks) + (local_parity + 1) * (SUBSTRIPE_DATA + 1) - 1;
 
-	global_parity = (virtual_stripe + 1) * (elegant_alg.stripe_blocks) - 1;
+	global_parity = (virtual_stripe + 1) * (ctx->stripe_blocks) - 1;
 	
 	// Parity in sequential	mode
 	if (ctx->io_pattern == SEQUENTIAL)
 	{
-		parity.start_sector = virtual_stripe * elegant_alg.stripe_blocks;
-		parity.start_device = sector_div(parity.start_sector, total_disks);
-		parity.start_sector = parity.start_sector * block_size;
-
-		for (i = 0; i < elegant_alg.p_blocks - 1; i++) {
-			parity.device_number[i] = (parity.start_device + SUBSTRIPE_DATA + i*(SUBSTRIPE_DATA + 1)) % ctx->ndev;
-			if (parity.device_number[i] < parity.start_device) {
-				parity.sector_number[i] = parity.start_sector + ctx->chunk_size;
+		parity->start_sector = virtual_stripe * ctx->stripe_blocks;
+		parity->start_device = insane_div(parity->start_sector, &ctx->ndev_div);
+		parity->start_sector = parity->start_sector * block_size;
+
+		for (i = 0; i < ctx->p_blocks - 1; i++) {
+			parity->device_number[i] = insane_mod(parity->start_device + SUBSTRIPE_DATA + i*(SUBSTRIPE_DATA + 1), &ctx->ndev_div);
+			if (parity->device_number[i] < parity->start_device) {
+				parity->sector_number[i] = parity->start_sector + ctx->chunk_size;
 			} else {
-				parity.sector_number[i] = parity.start_sector;
+				parity->sector_number[i] = parity->start_sector;
 			}
 		}
-		parity.device_number[i] = (parity.start_device + elegant_alg.stripe_blocks - 1) % ctx->ndev;
-		if (parity.device_number[i] < parity.start_device) {
-			parity.sector_number[i] = parity.start_sector + ctx->chunk_size;
+		parity->device_number[i] = insane_mod(parity->start_device + ctx->stripe_blocks - 1, &ctx->ndev_div);
+		if (parity->device_number[i] < parity->start_device) {
+			parity->sector_number[i] = parity->start_sector + ctx->chunk_size;
 		} else {
-			parity.sector_number[i] = parity.start_sector;
+			parity->sector_number[i] = parity->start_sector;
 		}
-		parity.device_number[i+1] = -1;
+		parity->count = i + 1;
 	
-		last_block = parity.start_device + elegant_alg.stripe_blocks - 4;
-		i = sector_div(last_block, total_disks);
-		last_block = i;
+		last_block = parity->start_device + ctx->stripe_blocks - 4;
+		last_block = insane_mod(last_block, &ctx->ndev_div);
 	}
 	// Parity in random mode
 	else {	
-		parity.device_number[0] = sector_div(local_parity, total_disks);
-		parity.device_number[1] = sector_div(global_parity, total_disks);
+		parity->device_number[0] = insane_div(local_parity, &ctx->ndev_div);
+		parity->device_number[1] = insane_div(global_parity, &ctx->ndev_div);
 
-		parity.sector_number[0] = local_parity * block_size;
-		parity.sector_number[1] = global_parity * block_size;
+		parity->sector_number[0] = local_parity * block_size;
+		parity->sector_number[1] = global_parity * block_size;
 	
-		parity.device_number[2] = -1;
+		parity->count = 2;
 
-		parity.start_sector = virtual_stripe * elegant_alg.stripe_blocks;
-		parity.start_device = sector_div(parity.start_sector, total_disks);
-		parity.start_sector = parity.start_sector * block_size;
+		parity->start_sector = virtual_stripe * ctx->stripe_blocks;
+		parity->start_device = insane_div(parity->start_sector, &ctx->ndev_div);
+		parity->start_sector = parity->start_sector * block_size;
 	}
 
-	// Okay, let's return to counting position of data block
-	// now we can calculate global_gap...
-	global_gap = virtual_stripe * (SUBSTRIPES + elegant_alg.e_blocks + 1);
-	
-	// ...and local_gap
-	local_gap = vs_position;	
-	sector_div(local_gap, SUBSTRIPE_DATA);
-
-	// Almost ready.
-	lane_pos = data_block + global_gap + local_gap;
-	
-	/*
-	 * Finally, we can get new device_number and sector number from lane_pos.
-	 */
-
-	*device_number = sector_div(lane_pos, total_disks);
-
-	parity.last_block = false;
+	parity->last_block = false;
 	if (ctx->io_pattern == SEQUENTIAL)
 	{
 		if (*device_number == last_block)
-			parity.last_block = true;
+			parity->last_block = true;
 	}
-	
-	i = sector_div(*sector, block_size);
-	*sector = lane_pos * block_size + i;
-	
-	return parity;
 }
 
 
@@ -144,28 +140,28 @@ static struct recover_stripe recover_from_stripe_to_empty(struct insane_c *ctx,
     int total_disks, i, j, block_in_stripe;
     u64 chunk_size, stripe_number, sector, substripe_number, empty_device;
 
-    total_disks = elegant_alg.ndisks;
+    total_disks = ctx->ndev;
     chunk_size = ctx->chunk_size;
 
     // calculating stripe number
     stripe_number = block * total_disks + device_number;
-    block_in_stripe = sector_div(stripe_number, elegant_alg.stripe_blocks);
+    block_in_stripe = sector_div(stripe_number, ctx->stripe_blocks);
 
     // GLOBAL SYNDROME case
-    if (block_in_stripe == elegant_alg.stripe_blocks - 1) {
+    if (block_in_stripe == ctx->stripe_blocks - 1) {
         substripe_number = 0;
-        for (i = 0; i < elegant_alg.stripe_blocks - 1 - SUBSTRIPES - E_BLOCKS; i++) {
+        for (i = 0; i < ctx->stripe_blocks - 1 - SUBSTRIPES - E_BLOCKS; i++) {
             // calculating substripe number for current block
             substripe_number = substripe_number + i + 1;
             sector_div(substripe_number, (SUBSTRIPE_DATA + 1));
 
             // calculating read parameteres
-            sector = stripe_number * elegant_alg.stripe_blocks + i + substripe_number;
+            sector = stripe_number * ctx->stripe_blocks + i + substripe_number;
             result.read_device[i] = sector_div(sector, total_disks);
             result.read_sector[i] = sector * chunk_size;
         }
 
-        result.quantity = elegant_alg.stripe_blocks - 1 - SUBSTRIPES - E_BLOCKS;
+        result.quantity = ctx->stripe_blocks - 1 - SUBSTRIPES - E_BLOCKS;
         
         /*
         // we don't need to handle this event. 
@@ -185,7 +181,7 @@ static struct recover_stripe recover_from_stripe_to_empty(struct insane_c *ctx,
     }
 
     // EMPTY BLOCK case
-    if (block_in_stripe == elegant_alg.stripe_blocks - 2) {
+    if (block_in_stripe == ctx->stripe_blocks - 2) {
         result.quantity = 0;
         result.write_device = -1;
         return result;
@@ -208,7 +204,7 @@ static struct recover_stripe recover_from_stripe_to_empty(struct insane_c *ctx,
     while (i < SUBSTRIPE_DATA + 1) {
         if (i + substripe_number * (SUBSTRIPE_DATA + 1) != block_in_stripe) {
 
-            sector = stripe_number * elegant_alg.stripe_blocks + // block in previous stripes
+            sector = stripe_number * ctx->stripe_blocks + // block in previous stripes
             substripe_number * (SUBSTRIPE_DATA + 1) + // blocks of previous substripes of current stripe
             i; // block in current substripe
             
@@ -220,7 +216,7 @@ static struct recover_stripe recover_from_stripe_to_empty(struct insane_c *ctx,
         i++;
     }
 
-    empty_device = device_number - block_in_stripe + elegant_alg.stripe_blocks - 2; // device with empty block
+    empty_device = device_number - block_in_stripe + ctx->stripe_blocks - 2; // device with empty block
 
     result.write_device = sector_div(empty_device, total_disks);
 
@@ -240,14 +236,14 @@ static struct recover_stripe recover_from_empty_to_new(struct insane_c *ctx, u64
     int total_disks;
     u64 chunk_size, stripe_number, read_sector;
 
-    total_disks = elegant_alg.ndisks;
+    total_disks = ctx->ndev;
     chunk_size = ctx->chunk_size;
 
     // calculating stripe number
     stripe_number = block * total_disks + device_number; // block in all RAID
-    sector_div(stripe_number, elegant_alg.stripe_blocks); // number of VS
+    sector_div(stripe_number, ctx->stripe_blocks); // number of VS
     
-    read_sector = stripe_number * elegant_alg.stripe_blocks + total_disks - 1;
+    read_sector = stripe_number * ctx->stripe_blocks + total_disks - 1;
     result.read_device[0] = sector_div(read_sector, total_disks);
     read_sector *= chunk_size;
     
@@ -267,29 +263,29 @@ static struct recover_stripe recover_from_stripe_to_new(struct insane_c *ctx, u6
     int total_disks, i, j, block_in_stripe;
     u64 chunk_size, stripe_number, sector, substripe_number;
 
-    total_disks = elegant_alg.ndisks;
+    total_disks = ctx->ndev;
     chunk_size = ctx->chunk_size;
 
     // calculating stripe number
     stripe_number = block * total_disks + device_number; // block in all RAID
-    block_in_stripe = sector_div(stripe_number, elegant_alg.stripe_blocks);
+    block_in_stripe = sector_div(stripe_number, ctx->stripe_blocks);
     
     // GLOBAL SYNDROME case
-    if (block_in_stripe == elegant_alg.stripe_blocks - 1) {
+    if (block_in_stripe == ctx->stripe_blocks - 1) {
         substripe_number = 0;
-        for (i = 0; i < elegant_alg.stripe_blocks - 1 - SUBSTRIPES; i++) {
+        for (i = 0; i < ctx->stripe_blocks - 1 - SUBSTRIPES; i++) {
             // calculating substripe number for current block
             substripe_number = substripe_number + i + 1;
             sector_div(substripe_number, (SUBSTRIPE_DATA + 1));
             
             // calculating read parameteres
-            sector = stripe_number * elegant_alg.stripe_blocks + i + substripe_number;
+            sector = stripe_number * ctx->stripe_blocks + i + substripe_number;
             result.read_device[i] = sector_div(sector, total_disks);
 
             result.read_sector[i] = sector * chunk_size;
         }
 
-        result.quantity = elegant_alg.stripe_blocks - 1 - SUBSTRIPES;
+        result.quantity = ctx->stripe_blocks - 1 - SUBSTRIPES;
 
         return result;
     }
@@ -308,7 +304,7 @@ static struct recover_stripe recover_from_stripe_to_new(struct insane_c *ctx, u6
     j = 0;
     while (i < SUBSTRIPE_DATA + 1) {
         if (i + substripe_number * (SUBSTRIPE_DATA + 1) != block_in_stripe) {
-            sector = stripe_number * elegant_alg.stripe_blocks + i + substripe_number * (SUBSTRIPE_DATA + 1);
+            sector = stripe_number * ctx->stripe_blocks + i + substripe_number * (SUBSTRIPE_DATA + 1);
             result.read_device[j] = sector_div(sector, total_disks);
             result.read_sector[j] = sector * chunk_size;
             j++;
@@ -324,15 +320,6 @@ static struct recover_stripe recover_from_stripe_to_new(struct insane_c *ctx, u6
     return result;
 }
 
-static int elegant_configure( struct insane_c *ctx )
-{
-	if (!ctx)
-		return -EINVAL;
-
-	elegant_alg.ndisks = ctx->ndev;
-	return 0;
-}
-
 static int __init insane_elegant_init( void )
 {
 	int r;
@@ -2,8 +2,7 @@
 #include <linux/slab.h>
 #include "insane.h"
 
-static struct parity_places algorithm_elegant_d( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number );
-static int elegant_d_configure( struct insane_c *ctx );
+static void algorithm_elegant_d( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity );
 
 #define SUBSTRIPES 2      // Substripes in virtual stripe
 #define SUBSTRIPE_DATA 5  // Substripe length without parity
@@ -16,30 +15,28 @@ struct insane_algorithm elegant_d_alg = {
 	.e_blocks   = E_BLOCKS,
 	.stripe_blocks = (SUBSTRIPE_DATA + 1) * SUBSTRIPES + E_BLOCKS + 1,
 	.map        = algorithm_elegant_d,
-	.configure  = elegant_d_configure,
     	.module     = THIS_MODULE
 };
 
 /*
  * Elegant algorithm of degraded RAID
  */
-static struct parity_places algorithm_elegant_d( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number )
+static void algorithm_elegant_d( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity )
 {
-	struct parity_places parity;
-	
 	u64 virtual_stripe;	
 	u64 vs_position;
 	u64 data_block, lane_pos, empty_pos;
 	u64 global_gap, local_gap;
-	u64 last_block;
 
 	sector_t local_parity, global_parity;
 	int block_size;
 	int total_disks;
 	int i;
+	int data_device;
+	bool degraded;
 	
 	block_size = ctx->chunk_size;
-	total_disks = elegant_d_alg.ndisks;
+	total_disks = ctx->ndev;
 
 	data_block = *device_number + block * total_disks;
 
@@ -50,67 +47,13 @@ static struct parity_places algorithm_elegant_d( struct insane_c *ctx, u64 block
 	 */
 	
 	virtual_stripe = data_block;
-	vs_position = sector_div(virtual_stripe, (SUBSTRIPE_DATA * SUBSTRIPES)); 
+	vs_position = insane_div(virtual_stripe, &ctx->data_div);
 	// virtual_stripe  	- number of vs.
 	// vs_position 		- offset in vs without counting parity.
 
-
-	// Now let's count positions of syndromes.
-	local_parity = vs_position;
-	sector_div(local_parity, SUBSTRIPE_DATA);
-	local_parity = (virtual_stripe * elegant_d_alg.stripe_blocks) + (local_parity + 1) * (SUBSTRIPE_DATA + 1) - 1;
-
-	global_parity = (virtual_stripe + 1) * (elegant_d_alg.stripe_blocks) - 1;
-
-	// Save this variable for degraded mode
-	empty_pos = global_parity - 1;
-
-	// Parity in sequential	mode
-	if (ctx->io_pattern == SEQUENTIAL)
-	{
-		parity.start_sector = virtual_stripe * elegant_d_alg.stripe_blocks;
-		parity.start_device = sector_div(parity.start_sector, total_disks);
-		parity.start_sector = parity.start_sector * block_size;
-
-		for (i = 0; i < elegant_d_alg.p_blocks - 1; i++) {
-			parity.device_number[i] = (parity.start_device + SUBSTRIPE_DATA + i*(SUBSTRIPE_DATA + 1)) % ctx->ndev;
-			if (parity.device_number[i] < parity.start_device) {
-				parity.sector_number[i] = parity.start_sector + ctx->chunk_size;
-			} else {
-				parity.sector_number[i] = parity.start_sector;
-			}
-		}
-		parity.device_number[i] = (parity.start_device + elegant_d_alg.stripe_blocks - 1) % ctx->ndev;
-		if (parity.device_number[i] < parity.start_device) {
-			parity.sector_number[i] = parity.start_sector + ctx->chunk_size;
-		} else {
-			parity.sector_number[i] = parity.start_sector;
-		}
-		parity.device_number[i+1] = -1;
-
-		last_block = parity.start_device + elegant_d_alg.stripe_blocks - 4;
-		i = sector_div(last_block, total_disks);
-		last_block = i;
-		
-	}
-	// Parity in random mode
-	else {	
-		parity.device_number[0] = sector_div(local_parity, total_disks);
-		parity.device_number[1] = sector_div(global_parity, total_disks);
-
-		parity.sector_number[0] = local_parity * block_size;
-		parity.sector_number[1] = global_parity * block_size;
-	
-		parity.device_number[2] = -1;
-
-		parity.start_sector = virtual_stripe * elegant_d_alg.stripe_blocks;
-		parity.start_device = sector_div(parity.start_sector, total_disks);
-		parity.start_sector = parity.start_sector * block_size;
-	}
-
-	// Okay, let's return to counting position of data block
+	// Let's count position of data block
 	// now we can calculate global_gap...
-	global_gap = virtual_stripe * (SUBSTRIPES + elegant_d_alg.e_blocks + 1);
+	global_gap = virtual_stripe * (SUBSTRIPES + ctx->e_blocks + 1);
 	
 	// ...and local_gap
 	local_gap = vs_position;	
@@ -123,15 +66,11 @@ static struct parity_places algorithm_elegant_d( struct insane_c *ctx, u64 block
 	 * Finally, we can get new device_number and sector number from lane_pos.
 	 */
 
-	*device_number = sector_div(lane_pos, total_disks);
+	*device_number = insane_div(lane_pos, &ctx->ndev_div);
+	// Remember it for sequential mode before degraded remap
+	data_device = *device_number;
+	degraded = (data_device == DEGRADED_DISK);
 
-	parity.last_block = false;
-	if (ctx->io_pattern == SEQUENTIAL)
-	{
-		if (*device_number == last_block)
-			parity.last_block = true;
-	}
-	
 	// Tricky thing, beware!
 	// We want to get lane_pos of empty_block.
 	// First of all, let's find lane_pos of block #0 in current VS:
@@ -141,36 +80,82 @@ static struct parity_places algorithm_elegant_d( struct insane_c *ctx, u64 block
 	// lane_pos += (SUBSTRIPE_DATA + 1) * SUBSTRIPES
 	//
 
-
-	if (*device_number == DEGRADED_DISK) {
+	if (degraded) {
 		lane_pos = data_block + global_gap - vs_position + (SUBSTRIPE_DATA + 1) * SUBSTRIPES;
-		*device_number = sector_div(lane_pos, total_disks);
+		*device_number = insane_div(lane_pos, &ctx->ndev_div);
 	}
-	else {
-		for (i = 0; i < elegant_d_alg.p_blocks; i++) {
-			if (parity.device_number[i] == -1)
-				break;
-			else if (parity.device_number[i] == DEGRADED_DISK) {
-				parity.device_number[i] = sector_div(empty_pos, total_disks);
-				parity.sector_number[i] = empty_pos * block_size;
-				break;
+	
+	i = *sector & (block_size - 1);
+	*sector = (lane_pos << ctx->chunk_size_shift) + i;
+
+	if (!parity)
+		return;
+
+	parity->last_block = false;
+
+	// Now let's count positions of syndromes.
+	local_parity = vs_position;
+	sector_div(local_parity, SUBSTRIPE_DATA);
+	local_parity = (virtual_stripe * ctx->stripe_blocks) + (local_parity + 1) * (SUBSTRIPE_DATA + 1) - 1;
+
+	global_parity = (virtual_stripe + 1) * (ctx->stripe_blocks) - 1;
+
+	// Save this variable for degraded mode
+	empty_pos = global_parity - 1;
+
+	// Parity in sequential	mode
+	if (ctx->io_pattern == SEQUENTIAL)
+	{
+		parity->start_sector = virtual_stripe * ctx->stripe_blocks;
+		parity->start_device = insane_div(parity->start_sector, &ctx->ndev_div);
+		parity->start_sector = parity->start_sector * block_size;
+
+		for (i = 0; i < ctx->p_blocks - 1; i++) {
+			parity->device_number[i] = insane_mod(parity->start_device + SUBSTRIPE_DATA + i*(SUBSTRIPE_DATA + 1), &ctx->ndev_div);
+			if (parity->device_number[i] < parity->start_device) {
+				parity->sector_number[i] = parity->start_sector + ctx->chunk_size;
+			} else {
+				parity->sector_number[i] = parity->start_sector;
 			}
 		}
+		parity->device_number[i] = insane_mod(parity->start_device + ctx->stripe_blocks - 1, &ctx->ndev_div);
+		if (parity->device_number[i] < parity->start_device) {
+			parity->sector_number[i] = parity->start_sector + ctx->chunk_size;
+		} else {
+			parity->sector_number[i] = parity->start_sector;
+		}
+		parity->count = i + 1;
+
+		i = parity->start_device + ctx->stripe_blocks - 4;
+		if (data_device == insane_mod(i, &ctx->ndev_div))
+			parity->last_block = true;
 	}
+	// Parity in random mode
+	else {	
+		parity->device_number[0] = insane_div(local_parity, &ctx->ndev_div);
+		parity->device_number[1] = insane_div(global_parity, &ctx->ndev_div);
+
+		parity->sector_number[0] = local_parity * block_size;
+		parity->sector_number[1] = global_parity * block_size;
 	
-	i = sector_div(*sector, block_size);
-	*sector = lane_pos * block_size + i;
-	
-	return parity;
-}
+		parity->count = 2;
 
-static int elegant_d_configure( struct insane_c *ctx )
-{
-	if (!ctx)
-		return -EINVAL;
+		parity->start_sector = virtual_stripe * ctx->stripe_blocks;
+		parity->start_device = insane_div(parity->start_sector, &ctx->ndev_div);
+		parity->start_sector = parity->start_sector * block_size;
+	}
 
-	elegant_d_alg.ndisks = ctx->ndev;
-	return 0;
+	// Data block was moved from degraded disk, so its syndromes stay in place
+	if (degraded)
+		return;
+
+	for (i = 0; i < parity->count; i++) {
+		if (parity->device_number[i] == DEGRADED_DISK) {
+			parity->device_number[i] = insane_div(empty_pos, &ctx->ndev_div);
+			parity->sector_number[i] = empty_pos * block_size;
+			break;
+		}
+	}
 }
 
 static int __init insane_elegant_d_init( void )
@@ -3,8 +3,9 @@
 #include <linux/device-mapper.h>
 #include "insane.h"
 
-static struct parity_places algorithm_elegant_rebuilt( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number );
+static void algorithm_elegant_rebuilt( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity );
 static int elegant_rebuilt_configure( struct insane_c *ctx );
+static void elegant_rebuilt_destroy( struct insane_c *ctx );
 
 #define SUBSTRIPES 2      // Substripes in virtual stripe
 #define SUBSTRIPE_DATA 5  // Substripe length without parity
@@ -18,33 +19,42 @@ struct insane_algorithm elegant_rebuilt_alg = {
 	.stripe_blocks = (SUBSTRIPE_DATA + 1) * SUBSTRIPES + E_BLOCKS + EXTRA_DISKS + 1,
 	.map        = algorithm_elegant_rebuilt,
 	.configure  = elegant_rebuilt_configure,
+	.destroy    = elegant_rebuilt_destroy,
+};
+
+// Per-device data, ctx->alg_data.
+// Divisors indexed by ext_mark: [0] - zone of new disks, [1] - zone of old disks
+struct rebuilt_data
+{
+	struct insane_divisor lane[2];   // Lane width
+	struct insane_divisor stripe[2]; // Virtual stripe width
 };
 
 /*
  * Elegant algorithm of rebuilt RAID.
  */
-static struct parity_places algorithm_elegant_rebuilt( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number )
+static void algorithm_elegant_rebuilt( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity )
 {
+	struct rebuilt_data *data = ctx->alg_data;
 	long long int length, ext_place;
 	sector_t vs_pos, lane_pos, ds_pos, i, local_gap, global_gap, ext_mark, gs_pos, ls_pos, ND, OD;
 	int block_size;
 	int total_disks;
 	int e_blocks;
 
-	struct parity_places parity;
 	/*
 	if(!ctx)
 		return -EINVAL;
 	*/
 
 	block_size = ctx->chunk_size;
-	total_disks = elegant_rebuilt_alg.ndisks;
-	e_blocks = elegant_rebuilt_alg.e_blocks;
+	total_disks = ctx->ndev;
+	e_blocks = ctx->e_blocks;
 
 	length = ctx->ti->len;
-	sector_div(length, total_disks);
+	insane_div(length, &ctx->ndev_div);
 	ext_place = length * (total_disks - EXTRA_DISKS);
-	sector_div(ext_place, block_size);
+	ext_place >>= ctx->chunk_size_shift;
 
 	ds_pos = *device_number + total_disks * block;
 
@@ -84,23 +94,36 @@ static struct parity_places algorithm_elegant_rebuilt( struct insane_c *ctx, u64
 			+ ext_mark * (global_gap + local_gap)	// old_disks
 			- (1 - ext_mark) * ext_place;		// new_disks
 
-	// Let's count parity
-	
+	// Save lane position for parity counting
 	gs_pos = lane_pos;
+
+	i = insane_div(lane_pos, &data->lane[ext_mark]);
+
+	*device_number = i;
+	// In case of old disks, it's enough
+	*device_number += (1 - ext_mark) * (total_disks - EXTRA_DISKS);
+	// But if we are in the zone of new disks, we should add the gap
+
+	i = *sector & (block_size - 1);
+
+	*sector = (lane_pos << ctx->chunk_size_shift) + i;
+
+	if (!parity)
+		return;
+
+	// Let's count parity
 	
-	sector_div(gs_pos,
-			ext_mark * (elegant_rebuilt_alg.stripe_blocks - EXTRA_DISKS)	// old disks
-			+ (1 - ext_mark) * (EXTRA_DISKS));			// new_disks
+	insane_div(gs_pos, &data->stripe[ext_mark]);
 
 	// gs_pos now is number of virtual stripe
 
-	parity.start_sector = gs_pos * elegant_rebuilt_alg.stripe_blocks;
+	parity->start_sector = gs_pos * ctx->stripe_blocks;
 
-	parity.start_device = sector_div(parity.start_sector, total_disks - EXTRA_DISKS);
-	parity.start_sector = parity.start_sector * block_size;
+	parity->start_device = insane_div(parity->start_sector, &data->lane[1]);
+	parity->start_sector = parity->start_sector * block_size;
 
 	// Now gs_pos is real position of the global syndrome
-	gs_pos = (gs_pos + 1) * elegant_rebuilt_alg.stripe_blocks - 1;
+	gs_pos = (gs_pos + 1) * ctx->stripe_blocks - 1;
 	
 	// It's time to count position of local syndrome!
 	
@@ -110,7 +133,7 @@ static struct parity_places algorithm_elegant_rebuilt( struct insane_c *ctx, u64
 	
 	// Firstly, let's find, where is the local syndrome, if we are in zone of old disks.
 	
-	OD = gs_pos - elegant_rebuilt_alg.stripe_blocks + EXTRA_DISKS + 1;
+	OD = gs_pos - ctx->stripe_blocks + EXTRA_DISKS + 1;
 	// Now OD is the position of the first block in current virtual stripe.
 	
 	OD = OD + vs_pos * (SUBSTRIPE_DATA + 1);
@@ -125,42 +148,43 @@ static struct parity_places algorithm_elegant_rebuilt( struct insane_c *ctx, u64
 	ls_pos = ext_mark * OD 	+ (1 - ext_mark) * ND;
 
 
-	parity.device_number[0] = sector_div(ls_pos, total_disks - EXTRA_DISKS);
-	parity.sector_number[0] = ls_pos * block_size;
+	parity->device_number[0] = insane_div(ls_pos, &data->lane[1]);
+	parity->sector_number[0] = ls_pos * block_size;
 
-	parity.device_number[1] = sector_div(gs_pos, total_disks - EXTRA_DISKS);
-	parity.sector_number[1] = gs_pos * block_size;
+	parity->device_number[1] = insane_div(gs_pos, &data->lane[1]);
+	parity->sector_number[1] = gs_pos * block_size;
 
-	// counting parity finished.
+	parity->count = 2;
+	parity->last_block = false;
+}
 
 
-	i = sector_div(lane_pos, 
-			ext_mark * (total_disks - EXTRA_DISKS)	// old_disks
-			+ (1 - ext_mark) * EXTRA_DISKS		// new_disks
-			);
+static int elegant_rebuilt_configure( struct insane_c *ctx )
+{
+	struct rebuilt_data *data;
 
-	*device_number = i;
-	// In case of old disks, it's enough
-	*device_number += (1 - ext_mark) * (total_disks - EXTRA_DISKS);
-	// But if we are in the zone of new disks, we should add the gap
+	if (!ctx)
+		return -EINVAL;
 
-	i = sector_div(*sector, block_size);
+	if (ctx->ndev <= EXTRA_DISKS)
+		return -EINVAL;
 
-	*sector = lane_pos * block_size + i;
+	data = kmalloc(sizeof(*data), GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
 
-	parity.device_number[2] = -1;
+	insane_div_init(&data->lane[0], EXTRA_DISKS);
+	insane_div_init(&data->lane[1], ctx->ndev - EXTRA_DISKS);
+	insane_div_init(&data->stripe[0], EXTRA_DISKS);
+	insane_div_init(&data->stripe[1], ctx->stripe_blocks - EXTRA_DISKS);
 
-	return parity;
+	ctx->alg_data = data;
+	return 0;
 }
 
-
-static int elegant_rebuilt_configure( struct insane_c *ctx )
+static void elegant_rebuilt_destroy( struct insane_c *ctx )
 {
-	if (!ctx)
-		return -EINVAL;
-
-	elegant_rebuilt_alg.ndisks = ctx->ndev;
-	return 0;
+	kfree(ctx->alg_data);
 }
 
 static int __init insane_elegant_rebuilt_init( void )
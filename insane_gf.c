@@ -0,0 +1,448 @@
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/jiffies.h>
+#include <linux/random.h>
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h>
+#include <asm/i387.h>
+#endif
+#include "insane.h"
+
+/*
+ * GF(2^8) Reed-Solomon engine.
+ *
+ * Field polynomial is 0x11d (as in RAID-6), generator is 2. Multiplication
+ * of a region by constant c uses split-nibble tables: c * x is
+ * low[x & 0xf] ^ high[x >> 4], so 32 bytes of table per constant. With
+ * SSSE3 both lookups are PSHUFB of 16 bytes at once, otherwise the same
+ * tables are used byte by byte.
+ *
+ * Codes are systematic Cauchy: c[j][i] = 1 / (x_j + y_i), x_j = j,
+ * y_i = m + i. Every square submatrix of Cauchy matrix is invertible, so
+ * any m lost blocks of k + m are recoverable.
+ */
+
+// Self-test and encode benchmark on load
+static int bench = 0;
+static int bench_data = 18;
+static int bench_syndromes = 4;
+
+static u8 gf_exp[512];
+static u8 gf_log[256];
+static u8 gf_nibble[256][32] __aligned(16); // low and high nibble products
+
+static bool gf_ssse3;
+
+static inline u8 gf_mul(u8 a, u8 b)
+{
+	if (!a || !b)
+		return 0;
+	return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline u8 gf_inv(u8 a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+static void gf_init_tables(void)
+{
+	int i, c;
+	u8 x = 1;
+
+	for (i = 0; i < 255; i++) {
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x = (x << 1) ^ ((x & 0x80) ? 0x1d : 0);
+	}
+
+	for (c = 0; c < 256; c++) {
+		for (i = 0; i < 16; i++) {
+			gf_nibble[c][i] = gf_mul(c, i);
+			gf_nibble[c][16 + i] = gf_mul(c, i << 4);
+		}
+	}
+}
+
+// dst ^= c * src
+static void gf_region_scalar(const u8 *tbl, size_t len, u8 *dst, const u8 *src)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] ^= tbl[src[i] & 0x0f] ^ tbl[16 + (src[i] >> 4)];
+}
+
+// dst ^= src by words, tail by bytes
+static void gf_xor_scalar(size_t len, u8 *dst, const u8 *src)
+{
+	size_t i;
+
+	for (i = 0; i + sizeof(long) <= len; i += sizeof(long))
+		*(unsigned long *)(dst + i) ^= *(const unsigned long *)(src + i);
+	for (; i < len; i++)
+		dst[i] ^= src[i];
+}
+
+#ifdef CONFIG_X86
+static const u8 gf_x0f[16] __aligned(16) = {
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+};
+
+// Caller holds kernel_fpu_begin
+static void gf_region_ssse3(const u8 *tbl, size_t len, u8 *dst, const u8 *src)
+{
+	asm volatile("movdqa %0, %%xmm7" : : "m" (gf_x0f[0]));
+	asm volatile("movdqa %0, %%xmm6" : : "m" (tbl[0]));
+	asm volatile("movdqa %0, %%xmm5" : : "m" (tbl[16]));
+
+	for (; len >= 16; len -= 16, src += 16, dst += 16) {
+		asm volatile("movdqu %0, %%xmm0" : : "m" (src[0]));
+		asm volatile("movdqa %xmm0, %xmm1");
+		asm volatile("psraw $4, %xmm1");
+		asm volatile("pand %xmm7, %xmm0");
+		asm volatile("pand %xmm7, %xmm1");
+		asm volatile("movdqa %xmm6, %xmm2");
+		asm volatile("movdqa %xmm5, %xmm3");
+		asm volatile("pshufb %xmm0, %xmm2");
+		asm volatile("pshufb %xmm1, %xmm3");
+		asm volatile("pxor %xmm3, %xmm2");
+		asm volatile("movdqu %0, %%xmm4" : : "m" (dst[0]));
+		asm volatile("pxor %xmm2, %xmm4");
+		asm volatile("movdqu %%xmm4, %0" : "=m" (dst[0]));
+	}
+
+	gf_region_scalar(tbl, len, dst, src);
+}
+
+// dst ^= src, caller holds kernel_fpu_begin
+static void gf_xor_sse(size_t len, u8 *dst, const u8 *src)
+{
+	for (; len >= 16; len -= 16, src += 16, dst += 16) {
+		asm volatile("movdqu %0, %%xmm0" : : "m" (src[0]));
+		asm volatile("movdqu %0, %%xmm1" : : "m" (dst[0]));
+		asm volatile("pxor %xmm0, %xmm1");
+		asm volatile("movdqu %%xmm1, %0" : "=m" (dst[0]));
+	}
+
+	gf_xor_scalar(len, dst, src);
+}
+#endif
+
+static inline void gf_begin(void)
+{
+#ifdef CONFIG_X86
+	if (gf_ssse3)
+		kernel_fpu_begin();
+#endif
+}
+
+static inline void gf_end(void)
+{
+#ifdef CONFIG_X86
+	if (gf_ssse3)
+		kernel_fpu_end();
+#endif
+}
+
+// dst ^= c * src, inside gf_begin/gf_end. xor_blocks can't be used here,
+// it takes FPU itself. c == 1 (LRC local and other XOR syndromes) is
+// plain XOR without table lookups.
+static void gf_region(u8 c, size_t len, void *dst, const void *src)
+{
+	if (!c)
+		return;
+
+#ifdef CONFIG_X86
+	if (gf_ssse3) {
+		if (c == 1)
+			gf_xor_sse(len, dst, src);
+		else
+			gf_region_ssse3(gf_nibble[c], len, dst, src);
+		return;
+	}
+#endif
+	if (c == 1)
+		gf_xor_scalar(len, dst, src);
+	else
+		gf_region_scalar(gf_nibble[c], len, dst, src);
+}
+
+struct insane_gf_code *insane_gf_code_create(int k, int m)
+{
+	struct insane_gf_code *code;
+	int i, j;
+
+	if (k < 1 || m < 1 || k + m > 256)
+		return NULL;
+
+	code = kmalloc(sizeof(*code) + k * m, GFP_KERNEL);
+	if (!code)
+		return NULL;
+
+	code->k = k;
+	code->m = m;
+	for (j = 0; j < m; j++)
+		for (i = 0; i < k; i++)
+			code->matrix[j * k + i] = gf_inv(j ^ (m + i));
+
+	return code;
+}
+EXPORT_SYMBOL(insane_gf_code_create);
+
+void insane_gf_code_free(struct insane_gf_code *code)
+{
+	kfree(code);
+}
+EXPORT_SYMBOL(insane_gf_code_free);
+
+void insane_gf_encode(struct insane_gf_code *code, size_t len, void **data, void **syndromes)
+{
+	int i, j;
+
+	gf_begin();
+	for (j = 0; j < code->m; j++) {
+		memset(syndromes[j], 0, len);
+		for (i = 0; i < code->k; i++)
+			gf_region(code->matrix[j * code->k + i], len, syndromes[j], data[i]);
+	}
+	gf_end();
+}
+EXPORT_SYMBOL(insane_gf_encode);
+
+void insane_gf_update(int count, const u8 *coef, size_t len, void **dst, const void *src)
+{
+	int j;
+
+	gf_begin();
+	for (j = 0; j < count; j++)
+		gf_region(coef[j], len, dst[j], src);
+	gf_end();
+}
+EXPORT_SYMBOL(insane_gf_update);
+
+// Invert n x n matrix a into b by Gauss-Jordan, a is destroyed
+static int gf_invert(u8 *a, u8 *b, int n)
+{
+	int i, j, r;
+	u8 t;
+
+	memset(b, 0, n * n);
+	for (i = 0; i < n; i++)
+		b[i * n + i] = 1;
+
+	for (i = 0; i < n; i++) {
+		for (r = i; r < n && !a[r * n + i]; r++)
+			;
+		if (r == n)
+			return -EINVAL;
+
+		if (r != i) {
+			for (j = 0; j < n; j++) {
+				swap(a[i * n + j], a[r * n + j]);
+				swap(b[i * n + j], b[r * n + j]);
+			}
+		}
+
+		t = gf_inv(a[i * n + i]);
+		for (j = 0; j < n; j++) {
+			a[i * n + j] = gf_mul(a[i * n + j], t);
+			b[i * n + j] = gf_mul(b[i * n + j], t);
+		}
+
+		for (r = 0; r < n; r++) {
+			t = a[r * n + i];
+			if (r == i || !t)
+				continue;
+			for (j = 0; j < n; j++) {
+				a[r * n + j] ^= gf_mul(a[i * n + j], t);
+				b[r * n + j] ^= gf_mul(b[i * n + j], t);
+			}
+		}
+	}
+
+	return 0;
+}
+
+int insane_gf_decode(struct insane_gf_code *code, size_t len, void **blocks, const int *erased, int count)
+{
+	int k = code->k, m = code->m;
+	u8 *a, *b, lost[256];
+	int *rows;
+	int i, j, n, data_lost;
+
+	if (count > m)
+		return -EINVAL;
+
+	memset(lost, 0, k + m);
+	data_lost = 0;
+	for (i = 0; i < count; i++) {
+		if (erased[i] < 0 || erased[i] >= k + m)
+			return -EINVAL;
+		lost[erased[i]] = 1;
+		if (erased[i] < k)
+			data_lost++;
+	}
+
+	if (data_lost) {
+		rows = kmalloc(k * sizeof(int) + 2 * k * k, GFP_NOIO);
+		if (!rows)
+			return -ENOMEM;
+		a = (u8 *)(rows + k);
+		b = a + k * k;
+
+		// Any k surviving blocks, rows of generator matrix for them
+		for (i = 0, n = 0; i < k + m && n < k; i++) {
+			if (lost[i])
+				continue;
+			rows[n] = i;
+			if (i < k) {
+				memset(&a[n * k], 0, k);
+				a[n * k + i] = 1;
+			} else {
+				memcpy(&a[n * k], &code->matrix[(i - k) * k], k);
+			}
+			n++;
+		}
+
+		if (gf_invert(a, b, k)) {
+			kfree(rows);
+			return -EINVAL;
+		}
+
+		gf_begin();
+		for (i = 0; i < k; i++) {
+			if (!lost[i])
+				continue;
+			memset(blocks[i], 0, len);
+			for (j = 0; j < k; j++)
+				gf_region(b[i * k + j], len, blocks[i], blocks[rows[j]]);
+		}
+		gf_end();
+
+		kfree(rows);
+	}
+
+	// Data is complete now, lost syndromes are encoded again
+	gf_begin();
+	for (j = 0; j < m; j++) {
+		if (!lost[k + j])
+			continue;
+		memset(blocks[k + j], 0, len);
+		for (i = 0; i < k; i++)
+			gf_region(code->matrix[j * k + i], len, blocks[k + j], blocks[i]);
+	}
+	gf_end();
+
+	return 0;
+}
+EXPORT_SYMBOL(insane_gf_decode);
+
+// Encode random stripe, lose m blocks (data first, last one is syndrome),
+// decode and compare
+#define GF_BENCH_LEN PAGE_SIZE
+static int gf_check(struct insane_gf_code *code, void **blocks, u8 *saved, int *erased)
+{
+	int k = code->k, m = code->m;
+	int i, r;
+
+	get_random_bytes(blocks[0], k * GF_BENCH_LEN);
+	insane_gf_encode(code, GF_BENCH_LEN, blocks, blocks + k);
+
+	for (i = 0; i < m; i++) {
+		erased[i] = (i == m - 1 && m > 1) ? k + m - 1 : i;
+		memcpy(saved + i * GF_BENCH_LEN, blocks[erased[i]], GF_BENCH_LEN);
+		memset(blocks[erased[i]], 0x5a, GF_BENCH_LEN);
+	}
+
+	r = insane_gf_decode(code, GF_BENCH_LEN, blocks, erased, m);
+	for (i = 0; i < m && !r; i++) {
+		if (memcmp(saved + i * GF_BENCH_LEN, blocks[erased[i]], GF_BENCH_LEN))
+			r = -EIO;
+	}
+
+	return r;
+}
+
+// Encode in a loop for HZ / 10 and report throughput
+static void gf_bench(struct insane_gf_code *code, void **blocks)
+{
+	unsigned long start, loops = 0;
+
+	start = jiffies;
+	while (time_before(jiffies, start + HZ / 10)) {
+		insane_gf_encode(code, GF_BENCH_LEN, blocks, blocks + code->k);
+		loops++;
+	}
+
+	dm_log("GF(2^8) %s encode k=%d m=%d: %lu MB/s of data\n", gf_ssse3 ? "ssse3" : "scalar",
+	       code->k, code->m, (loops * code->k * GF_BENCH_LEN * 10) >> 20);
+}
+
+static int gf_selftest(int k, int m)
+{
+	struct insane_gf_code *code;
+	void **blocks;
+	u8 *buf;
+	int i, r;
+
+	if (m > k + 1) // Erasures of gf_check must differ
+		return -EINVAL;
+
+	code = insane_gf_code_create(k, m);
+	if (!code)
+		return -EINVAL;
+
+	blocks = kmalloc((k + m) * (sizeof(void *) + sizeof(int)), GFP_KERNEL);
+	buf = kmalloc((k + m + m) * GF_BENCH_LEN, GFP_KERNEL);
+	if (!blocks || !buf) {
+		kfree(buf);
+		kfree(blocks);
+		insane_gf_code_free(code);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < k + m; i++)
+		blocks[i] = buf + i * GF_BENCH_LEN;
+
+	r = gf_check(code, blocks, buf + (k + m) * GF_BENCH_LEN, (int *)(blocks + k + m));
+	if (r)
+		dm_log("GF(2^8) self-test failed for k=%d m=%d: %d\n", k, m, r);
+	else
+		gf_bench(code, blocks);
+
+	kfree(buf);
+	kfree(blocks);
+	insane_gf_code_free(code);
+	return r;
+}
+
+static int __init insane_gf_init(void)
+{
+	gf_init_tables();
+
+#ifdef CONFIG_X86
+	gf_ssse3 = boot_cpu_has(X86_FEATURE_SSSE3);
+#endif
+
+	// Failure is only reported, syndromes are computed by insane_gf_update
+	if (bench)
+		gf_selftest(bench_data, bench_syndromes);
+
+	return 0;
+}
+
+static void __exit insane_gf_exit(void)
+{
+}
+
+module_init(insane_gf_init);
+module_exit(insane_gf_exit);
+
+module_param( bench, int, S_IRUGO );
+module_param( bench_data, int, S_IRUGO );
+module_param( bench_syndromes, int, S_IRUGO );
+
+MODULE_LICENSE("GPL");
@@ -1,6 +1,7 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/hash.h>
+#include <linux/percpu.h>
 #include "insane.h"
 
 #include "hashed.c"
@@ -8,8 +9,237 @@
 static u64 rslts[21] = 
 {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
 
-static struct parity_places algorithm_hashed( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number );
-static int hashed_configure( struct insane_c *ctx );
+static void algorithm_hashed( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity );
+static void algorithm_feistel( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity );
+static struct recover_stripe recover_feistel(struct insane_c *ctx, u64 block, int device_number);
+
+// Same declustered placement, but every stripe is permuted with a keyed
+// Feistel network instead of a materialized Fisher-Yates shuffle.
+struct insane_algorithm feistel_alg = {
+	.name       = "hashed_feistel",
+	.p_blocks   = SUBSTRIPES + GLOBAL_S,
+	.e_blocks   = E_BLOCKS,
+	.stripe_blocks = (SUBSTRIPE_DATA + 1) * SUBSTRIPES + E_BLOCKS + GLOBAL_S,
+	.map        = algorithm_feistel,
+	.recover    = recover_feistel,
+	.gf         = true,
+	.module     = THIS_MODULE
+};
+
+/*
+ * Feistel placement.
+ *
+ * Slot k of starting_scheme is placed on position feistel_forward(N, k) of
+ * virtual stripe N. Both directions are computed directly: the network is
+ * a bijection on [0, 4^FEISTEL_HALF_BITS) and cycle-walking restricts it
+ * to [0, stripe_blocks). Nothing is built per stripe.
+ */
+#define HASHED_BLOCKS ((SUBSTRIPE_DATA + 1) * SUBSTRIPES + E_BLOCKS + GLOBAL_S)
+#define FEISTEL_ROUNDS 4
+
+// Slots of starting_scheme, built once on module load.
+static unsigned char feistel_data[SUBSTRIPE_DATA * SUBSTRIPES]; // slot of n-th data block
+static unsigned char feistel_ls[SUBSTRIPES];                    // local syndrome slot of group
+static unsigned char feistel_gs[GLOBAL_S];                      // global syndrome slots
+static unsigned char feistel_eb;                                // empty slot
+static unsigned int feistel_half_bits;                          // bits in one half of domain
+
+// Global syndromes of both algorithms, Cauchy code of all data blocks
+static struct insane_gf_code *hashed_code;
+
+// Coefficient of data block vs_position in global syndrome j
+static inline u8 hashed_gs_coef(int j, int vs_position)
+{
+	return hashed_code->matrix[j * hashed_code->k + vs_position];
+}
+
+static u32 feistel_key(u64 number)
+{
+	return (u32)hash_64(number, 32);
+}
+
+static u32 feistel_round(u32 half, u32 key, int round)
+{
+	return hash_32(half ^ (key + round * 0x9e3779b9), feistel_half_bits);
+}
+
+static u32 feistel_forward(u32 key, u32 x)
+{
+	u32 mask = (1 << feistel_half_bits) - 1;
+	u32 l, r, t;
+	int i;
+
+	do {
+		l = x >> feistel_half_bits;
+		r = x & mask;
+		for (i = 0; i < FEISTEL_ROUNDS; i++) {
+			t = r;
+			r = l ^ feistel_round(r, key, i);
+			l = t;
+		}
+		x = (l << feistel_half_bits) | r;
+	} while (x >= HASHED_BLOCKS); // cycle-walking
+
+	return x;
+}
+
+static u32 feistel_inverse(u32 key, u32 x)
+{
+	u32 mask = (1 << feistel_half_bits) - 1;
+	u32 l, r, t;
+	int i;
+
+	do {
+		l = x >> feistel_half_bits;
+		r = x & mask;
+		for (i = FEISTEL_ROUNDS - 1; i >= 0; i--) {
+			t = l;
+			l = r ^ feistel_round(l, key, i);
+			r = t;
+		}
+		x = (l << feistel_half_bits) | r;
+	} while (x >= HASHED_BLOCKS);
+
+	return x;
+}
+
+// Translate slot of virtual stripe to device and chunk start sector
+static void feistel_place(struct insane_c *ctx, u64 stripe_start, u32 key, int slot, int *device_number, sector_t *sector)
+{
+	insane_lane_place(ctx, stripe_start + feistel_forward(key, slot), device_number, sector);
+}
+
+static void algorithm_feistel( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity )
+{
+	u64 virtual_stripe, stripe_start;
+	u64 vs_position;
+	sector_t block_offset;
+	u32 key;
+	int i, j;
+	unsigned char group;
+
+	// number of data block (block in raid which is not empty or syndrome)
+	virtual_stripe = *device_number + block * ctx->ndev;
+	vs_position = insane_div(virtual_stripe, &ctx->data_div);
+
+	key = feistel_key(virtual_stripe);
+	stripe_start = virtual_stripe * ctx->stripe_blocks;
+
+	block_offset = *sector & (ctx->chunk_size - 1);
+	feistel_place(ctx, stripe_start, key, feistel_data[vs_position], device_number, sector);
+	*sector += block_offset;
+
+	if (!parity)
+		return;
+
+	feistel_place(ctx, stripe_start, key, 0, &parity->start_device, &parity->start_sector);
+
+	group = starting_scheme[feistel_data[vs_position]];
+
+	// Parity in sequential mode: all syndromes of stripe
+	if (ctx->io_pattern == SEQUENTIAL)
+	{
+		for (i = 0; i < SUBSTRIPES; i++) {
+			feistel_place(ctx, stripe_start, key, feistel_ls[i],
+				      &parity->device_number[i], &parity->sector_number[i]);
+			parity->coef[i] = (i == group);
+		}
+	}
+	// Parity in random mode: local syndrome of block group
+	else {
+		feistel_place(ctx, stripe_start, key, feistel_ls[group],
+			      &parity->device_number[0], &parity->sector_number[0]);
+		parity->coef[0] = 1;
+		i = 1;
+	}
+
+	for (j = 0; j < GLOBAL_S; j++, i++) {
+		feistel_place(ctx, stripe_start, key, feistel_gs[j],
+			      &parity->device_number[i], &parity->sector_number[i]);
+		parity->coef[i] = hashed_gs_coef(j, vs_position);
+	}
+
+	parity->count = i;
+
+	// Data blocks are written in vs_position order
+	parity->last_block = false;
+	if (ctx->io_pattern == SEQUENTIAL)
+		parity->last_block = (vs_position == SUBSTRIPE_DATA * SUBSTRIPES - 1);
+}
+
+static struct recover_stripe recover_feistel(struct insane_c *ctx, u64 block, int device_number) {
+	struct recover_stripe result;
+
+	u64 stripe_number, stripe_start;
+	u32 key;
+	int i, j, slot;
+	unsigned char role;
+
+	// calculating stripe number
+	stripe_number = block * ctx->ndev + device_number;
+	slot = sector_div(stripe_number, ctx->stripe_blocks);
+
+	key = feistel_key(stripe_number);
+	stripe_start = stripe_number * ctx->stripe_blocks;
+
+	slot = feistel_inverse(key, slot);
+	role = starting_scheme[slot];
+
+	// EMPTY BLOCK case
+	if (role == 0xee) {
+		result.quantity = 0;
+		result.write_device = -1;
+
+		return result;
+	}
+
+	j = 0;
+	for (i = 0; i < HASHED_BLOCKS; i++) {
+		if (i == slot)
+			continue;
+
+		// GLOBAL SYNDROME case: read all data blocks,
+		// other cases: read the rest of the group
+		if ((role == 0xff) ? (starting_scheme[i] < 0xc0) :
+		    ((starting_scheme[i] | 0xc0) == (role | 0xc0))) {
+			feistel_place(ctx, stripe_start, key, i,
+				      &result.read_device[j], &result.read_sector[j]);
+			j++;
+		}
+	}
+	result.quantity = j;
+
+	feistel_place(ctx, stripe_start, key, feistel_eb,
+		      &result.write_device, &result.write_sector);
+
+	return result;
+}
+
+// Collect slots of starting_scheme used by feistel placement
+static void feistel_init(void)
+{
+	int i, data;
+
+	data = 0;
+	for (i = 0; i < HASHED_BLOCKS; i++) {
+		if (starting_scheme[i] < 0xc0)
+			feistel_data[data++] = i;
+		else if (starting_scheme[i] < 0xd0)
+			feistel_ls[starting_scheme[i] & 0x0f] = i;
+		else if (starting_scheme[i] == 0xee)
+			feistel_eb = i;
+	}
+
+	data = 0;
+	for (i = 0; i < HASHED_BLOCKS; i++)
+		if (starting_scheme[i] == 0xff)
+			feistel_gs[data++] = i;
+
+	// Smallest even-sized power of two domain covering the stripe
+	feistel_half_bits = 1;
+	while ((1 << (2 * feistel_half_bits)) < HASHED_BLOCKS)
+		feistel_half_bits++;
+}
 
 static struct recover_stripe recover_hashed(struct insane_c *ctx, u64 block, int device_number);
 
@@ -20,18 +250,18 @@ struct insane_algorithm hashed_alg = {
 	.stripe_blocks = (SUBSTRIPE_DATA + 1) * SUBSTRIPES + E_BLOCKS + GLOBAL_S,
 	.map        = algorithm_hashed,
         .recover    = recover_hashed,
-	.configure  = hashed_configure,
+	.gf         = true,
         .module     = THIS_MODULE
 };
 
 struct hashed_stripe {
     unsigned char hashed_scheme[(SUBSTRIPE_DATA + 1) * SUBSTRIPES + E_BLOCKS + GLOBAL_S];
     unsigned char hashed_data[SUBSTRIPE_DATA * SUBSTRIPES];
+    unsigned char hashed_slot[SUBSTRIPE_DATA * SUBSTRIPES]; // position of n-th data block
+    unsigned char hashed_dls[SUBSTRIPE_DATA * SUBSTRIPES];  // position of its local syndrome
     int hashed_gs[GLOBAL_S];
-    int hashed_ls[SUBSTRIPES];
+    int hashed_ls[SUBSTRIPES]; // by group
     int hashed_eb;
-    int hashed_offset[SUBSTRIPES + E_BLOCKS + GLOBAL_S];
-    int hashed_ldb;
 };
 
 static void print_stripe(unsigned char *scheme) {
@@ -75,12 +305,11 @@ static void fisher_yates_randomizing(u64 hash, unsigned char *scheme) {
     }
 }
 
-static struct hashed_stripe get_stripe(sector_t number) {
+static void build_stripe(sector_t number, struct hashed_stripe *strp) {
     u64 hash;
-    int i,j,k,t,q;
+    int i,j,k;
     
     unsigned char random_scheme[(SUBSTRIPE_DATA + 1) * SUBSTRIPES + E_BLOCKS + GLOBAL_S];
-    struct hashed_stripe strp;
 
     hash = number;//hash_64(number, 32); // 32 bits
 
@@ -91,190 +320,138 @@ static struct hashed_stripe get_stripe(sector_t number) {
     fisher_yates_randomizing(hash, random_scheme);
 
     for (i = 0; i < ((SUBSTRIPE_DATA + 1) * SUBSTRIPES + E_BLOCKS + GLOBAL_S); i++) {
-        strp.hashed_scheme[i] = random_scheme[i];
+        strp->hashed_scheme[i] = random_scheme[i];
     }
 
     i = 0;
     j = 0;
     k = 0;
-    t = 0;
-    q = 0;
     
     while (i < ((SUBSTRIPE_DATA + 1) * SUBSTRIPES + E_BLOCKS + GLOBAL_S)) {
-        if (strp.hashed_scheme[i] < 0xc0) { // data block
-            strp.hashed_data[j] = strp.hashed_scheme[i];
+        if (strp->hashed_scheme[i] < 0xc0) { // data block
+            strp->hashed_data[j] = strp->hashed_scheme[i];
+            strp->hashed_slot[j] = i;
             j += 1;
         } else {
-            strp.hashed_offset[q] = i;
-            q += 1;
-            if (strp.hashed_scheme[i] < 0xd0) {
-                strp.hashed_ls[t] = i;
-                t += 1;
+            if (strp->hashed_scheme[i] < 0xd0) {
+                strp->hashed_ls[strp->hashed_scheme[i] - 0xc0] = i;
             }
 
-            if (strp.hashed_scheme[i] == 0xff) {
-                strp.hashed_gs[k] = i;
+            if (strp->hashed_scheme[i] == 0xff) {
+                strp->hashed_gs[k] = i;
                 k += 1;
             }
 
-            if (strp.hashed_scheme[i] == 0xee) {
-                strp.hashed_eb = i;
+            if (strp->hashed_scheme[i] == 0xee) {
+                strp->hashed_eb = i;
             }
         }
         i += 1;
     }
     
-    for (i = ((SUBSTRIPE_DATA + 1) * SUBSTRIPES + E_BLOCKS + GLOBAL_S - 1); i > 0; i--) {
-        if (strp.hashed_scheme[i] < 0xc0) {
-            strp.hashed_ldb = i;
-            break;
-        }
+    for (j = 0; j < SUBSTRIPE_DATA * SUBSTRIPES; j++) {
+        strp->hashed_dls[j] = strp->hashed_ls[strp->hashed_data[j]];
+    }
+}
+
+// Decoded stripes are cached per CPU. Sequential and rebuild workloads hit
+// the same virtual stripe many times in a row, so we don't want to
+// repeat the shuffle for each block. The cache is direct-mapped by
+// stripe number: neighbouring stripes never evict each other.
+#define HASHED_CACHE_SIZE 16 // Must be power of 2
+
+struct hashed_cache_entry {
+    bool valid;
+    u64 number;
+    struct hashed_stripe strp;
+};
+
+struct hashed_cache {
+    struct hashed_cache_entry entry[HASHED_CACHE_SIZE];
+};
+
+static struct hashed_cache __percpu *hashed_cache;
+
+static struct hashed_stripe get_stripe(sector_t number) {
+    struct hashed_cache_entry *entry;
+    struct hashed_stripe strp;
+
+    entry = &get_cpu_ptr(hashed_cache)->entry[number & (HASHED_CACHE_SIZE - 1)];
+    if (!entry->valid || entry->number != number) {
+        build_stripe(number, &entry->strp);
+        entry->number = number;
+        entry->valid = true;
     }
+    strp = entry->strp;
+    put_cpu_ptr(hashed_cache);
 
     return strp;
-    
 }
 
 /*
  * LRC RAID algorithm
  */
-static struct parity_places algorithm_hashed( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number )
+static void algorithm_hashed( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity )
 {
-	struct parity_places parity;
-	
         struct hashed_stripe strp;
 
-	u64 virtual_stripe;	
+	u64 virtual_stripe, stripe_start;
 	u64 vs_position;
-	u64 data_block, lane_pos;
-	u64 global_gap, local_gap;
-	u64 last_block;
-
-	sector_t local_parity, global_parity;
-	int block_size;
-	int total_disks;
-	int i,j;
-        unsigned char group;
-
-
-
-	block_size = ctx->chunk_size;
-	total_disks = hashed_alg.ndisks;
+	sector_t block_offset;
+	int i, j;
 
         // number of data block (block in raid which is not empty or syndrome)
-	data_block = *device_number + block * total_disks;
+	virtual_stripe = *device_number + block * ctx->ndev;
 
-	/*
-	 * Let's get position of block in VS.
-	 * SUBSTRIPE_DATA - quantity of data blocks in substripe;
-	 * SUBSTRIPES - quantity of substripes in VS;
-	 */
-	
-	virtual_stripe = data_block;
-	vs_position = sector_div(virtual_stripe, (SUBSTRIPE_DATA * SUBSTRIPES)); 
 	// virtual_stripe  	- number of vs.
 	// vs_position 		- offset in vs without counting parity.
+	vs_position = insane_div(virtual_stripe, &ctx->data_div);
 
         strp = get_stripe(virtual_stripe);
 
-	// Now let's get positions of syndromes.
-        group = strp.hashed_data[vs_position];
-        local_parity = strp.hashed_ls[group];
-	local_parity = (virtual_stripe * hashed_alg.stripe_blocks) + local_parity;
-	//global_parity = virtual_stripe * hashed_alg.stripe_blocks + hashed_gs;
-	
-	// Parity in sequential	mode
+	stripe_start = virtual_stripe * ctx->stripe_blocks;
+
+	block_offset = *sector & (ctx->chunk_size - 1);
+	insane_lane_place(ctx, stripe_start + strp.hashed_slot[vs_position], device_number, sector);
+	*sector += block_offset;
+
+	if (!parity)
+		return;
+
+	insane_lane_place(ctx, stripe_start, &parity->start_device, &parity->start_sector);
+
+	// Parity in sequential	mode: all syndromes of stripe
 	if (ctx->io_pattern == SEQUENTIAL)
 	{
-		parity.start_sector = virtual_stripe * hashed_alg.stripe_blocks;
-		parity.start_device = sector_div(parity.start_sector, total_disks);
-		parity.start_sector = parity.start_sector * block_size;
-
 		for (i = 0; i < SUBSTRIPES; i++) {
-                        // local syndromes
-			parity.device_number[i] = (parity.start_device + strp.hashed_ls[i]) % ctx->ndev;
-			if (parity.device_number[i] < parity.start_device) {
-				parity.sector_number[i] = parity.start_sector + ctx->chunk_size;
-			} else {
-				parity.sector_number[i] = parity.start_sector;
-			}
+			insane_lane_place(ctx, stripe_start + strp.hashed_ls[i],
+					  &parity->device_number[i], &parity->sector_number[i]);
+			parity->coef[i] = (strp.hashed_ls[i] == strp.hashed_dls[vs_position]);
 		}
-                // global syndromes
-                for (j = 0; i < SUBSTRIPES + GLOBAL_S; i++) {
-    		    parity.device_number[i] = (parity.start_device + strp.hashed_gs[j]) % ctx->ndev;
-
-		    if (parity.device_number[i] < parity.start_device) {
-			parity.sector_number[i] = parity.start_sector + ctx->chunk_size;
-        	    } else {
-	    		parity.sector_number[i] = parity.start_sector;
-	            }
-                    
-                    j++;
-                }
-                // breakpoint
-		parity.device_number[i] = -1;
-	
-		last_block = parity.start_device + strp.hashed_ldb;
-		i = sector_div(last_block, total_disks);
-		last_block = i;
 	}
-	// Parity in random mode
-	else {	
-		parity.device_number[0] = sector_div(local_parity, total_disks);
-		parity.sector_number[0] = local_parity * block_size;
-
-                for (i = 0; i < GLOBAL_S; i++) {
-                    global_parity = virtual_stripe * hashed_alg.stripe_blocks + strp.hashed_gs[i];
-                    parity.device_number[i+1] = sector_div(global_parity, total_disks);
-                    parity.sector_number[i+1] = global_parity * block_size;    
-                }
-
-	        //breakpoint
-                parity.device_number[i+1] = -1;
-
-		parity.start_sector = virtual_stripe * hashed_alg.stripe_blocks;
-		parity.start_device = sector_div(parity.start_sector, total_disks);
-		parity.start_sector = parity.start_sector * block_size;
+	// Parity in random mode: local syndrome of block group
+	else {
+		insane_lane_place(ctx, stripe_start + strp.hashed_dls[vs_position],
+				  &parity->device_number[0], &parity->sector_number[0]);
+		parity->coef[0] = 1;
+		i = 1;
 	}
 
-	// Okay, let's return to counting position of data block
-	// now we can calculate global_gap...
-	global_gap = virtual_stripe * (SUBSTRIPES + E_BLOCKS + GLOBAL_S);
-	
-	// ...and local_gap
-	local_gap = vs_position;
-        i = 0;
-        while (i < SUBSTRIPES + E_BLOCKS + GLOBAL_S) {
-            if (local_gap >= strp.hashed_offset[i]) {
-                local_gap++;
-            }
-            i++;
-        }
-
-	// Almost ready.
-	lane_pos = data_block + global_gap + local_gap - vs_position;
-        
-	/*
-	 * Finally, we can get new device_number and sector number from lane_pos.
-	 */
+	// global syndromes
+	for (j = 0; j < GLOBAL_S; j++, i++) {
+		insane_lane_place(ctx, stripe_start + strp.hashed_gs[j],
+				  &parity->device_number[i], &parity->sector_number[i]);
+		parity->coef[i] = hashed_gs_coef(j, vs_position);
+	}
 
-	*device_number = sector_div(lane_pos, total_disks);
+	parity->count = i;
 
-	parity.last_block = false;
+	// Data blocks are written in vs_position order
+	parity->last_block = false;
 	if (ctx->io_pattern == SEQUENTIAL)
-	{
-	    if (*device_number == last_block)
-		parity.last_block = true;
-	}
-	
-	i = sector_div(*sector, block_size);
-	*sector = lane_pos * block_size + i;
-        
-
-	return parity;
+		parity->last_block = (vs_position == SUBSTRIPE_DATA * SUBSTRIPES - 1);
 }
 
-
 static struct recover_stripe recover_hashed(struct insane_c *ctx, u64 block, int device_number) {
     struct recover_stripe result;
     
@@ -287,12 +464,12 @@ static struct recover_stripe recover_hashed(struct insane_c *ctx, u64 block, int
 
     unsigned char pattern;
 
-    total_disks = hashed_alg.ndisks;
+    total_disks = ctx->ndev;
     chunk_size = ctx->chunk_size;
 
     // calculating stripe number
     stripe_number = block * total_disks + device_number;
-    block_in_stripe = sector_div(stripe_number, hashed_alg.stripe_blocks);
+    block_in_stripe = sector_div(stripe_number, ctx->stripe_blocks);
 
     strp = get_stripe(stripe_number);
     //print_stripe(strp.hashed_scheme);
@@ -309,10 +486,10 @@ static struct recover_stripe recover_hashed(struct insane_c *ctx, u64 block, int
     if (gs) {
         substripe_number = 0;
         j = 0;
-        for (i = 0; i < hashed_alg.stripe_blocks; i++) {
+        for (i = 0; i < ctx->stripe_blocks; i++) {
             if (strp.hashed_scheme[i] < 16) {
                 // calculating read parameteres
-                sector = stripe_number * hashed_alg.stripe_blocks + i; 
+                sector = stripe_number * ctx->stripe_blocks + i; 
                 result.read_device[j] = sector_div(sector, total_disks);
                 result.read_sector[j] = sector * chunk_size;
                 rslts[result.read_device[j]] += 1;
@@ -320,7 +497,7 @@ static struct recover_stripe recover_hashed(struct insane_c *ctx, u64 block, int
             }
         }
 
-        result.quantity = hashed_alg.stripe_blocks - GLOBAL_S - SUBSTRIPES - E_BLOCKS;
+        result.quantity = ctx->stripe_blocks - GLOBAL_S - SUBSTRIPES - E_BLOCKS;
         
         result.write_device = device_number - block_in_stripe + strp.hashed_eb;
         result.write_sector = block * chunk_size;
@@ -350,11 +527,11 @@ static struct recover_stripe recover_hashed(struct insane_c *ctx, u64 block, int
 
     j = 0;
 
-    for (i = 0; i < hashed_alg.stripe_blocks; i++) {
+    for (i = 0; i < ctx->stripe_blocks; i++) {
         pattern = strp.hashed_scheme[i] | 0xc0; // now pattern can be local syndrome of group, global syndrome or empty block.
         
         if ((pattern == substripe_number) && (i != block_in_stripe)) {
-            sector = stripe_number * hashed_alg.stripe_blocks + i;
+            sector = stripe_number * ctx->stripe_blocks + i;
             result.read_device[j] = sector_div(sector, total_disks);
             result.read_sector[j] = sector * chunk_size;
             rslts[result.read_device[j]] += 1;
@@ -376,22 +553,39 @@ static struct recover_stripe recover_hashed(struct insane_c *ctx, u64 block, int
     return result;
 }
 
-static int hashed_configure( struct insane_c *ctx )
-{
-	if (!ctx)
-		return -EINVAL;
-
-	hashed_alg.ndisks = ctx->ndev;
-	return 0;
-}
-
 static int __init insane_hashed_init( void )
 {
 	int r;
 	
+	hashed_cache = alloc_percpu(struct hashed_cache);
+	if (!hashed_cache)
+		return -ENOMEM;
+
+	hashed_code = NULL;
+	if (GLOBAL_S) {
+		hashed_code = insane_gf_code_create(SUBSTRIPE_DATA * SUBSTRIPES, GLOBAL_S);
+		if (!hashed_code) {
+			free_percpu(hashed_cache);
+			return -ENOMEM;
+		}
+	}
+
+	feistel_init();
+
 	r = insane_register( &hashed_alg );
-	if (r)
+	if (r) {
+		insane_gf_code_free(hashed_code);
+		free_percpu(hashed_cache);
 		return r;
+	}
+
+	r = insane_register( &feistel_alg );
+	if (r) {
+		insane_unregister( &hashed_alg );
+		insane_gf_code_free(hashed_code);
+		free_percpu(hashed_cache);
+		return r;
+	}
 	
 	return 0;
 }
@@ -403,7 +597,10 @@ static void __exit insane_hashed_exit( void )
             printk("%lld, ",rslts[i]);
         }
         printk("\n");
+	insane_unregister( &feistel_alg );
 	insane_unregister( &hashed_alg );
+	insane_gf_code_free(hashed_code);
+	free_percpu(hashed_cache);
 }
 
 module_init(insane_hashed_init);
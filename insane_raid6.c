@@ -1,8 +1,10 @@
 #include <linux/module.h>
+#include <linux/slab.h>
 #include "insane.h"
 
-static struct parity_places algorithm_raid6( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number );
+static void algorithm_raid6( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity );
 static int raid6_configure( struct insane_c *ctx );
+static void raid6_destroy( struct insane_c *ctx );
 static struct recover_stripe raid6_recover(struct insane_c *ctx, u64 block, int device_number);
 
 struct insane_algorithm raid6_alg = {
@@ -11,36 +13,127 @@ struct insane_algorithm raid6_alg = {
 	.e_blocks = 0,
 	.map = algorithm_raid6,
 	.configure = raid6_configure,
+	.destroy = raid6_destroy,
         .recover = raid6_recover,
+	.pq = true,
 	.module = THIS_MODULE
 };
 
-// Sector and device mapping callback
-static struct parity_places algorithm_raid6(struct insane_c *ctx, u64 block, sector_t *sector, int *device_number)
+// Placement of one data block inside the layout period.
+// The layout repeats every ndisks lanes, so the whole period
+// (ndisks lanes of ndisks - 2 data blocks) is precomputed in configure.
+struct raid6_place
+{
+	u16  device;     // Member holding the data block
+	u16  lane;       // Lane offset inside the period
+	u16  parity[2];  // Syndrome members of that lane
+	bool last_block; // Last data block of the lane
+};
+
+// Per-device layout, ctx->alg_data
+struct raid6_data
 {
-	struct parity_places parity;
+	struct insane_divisor period; // Data blocks in one period
+	struct raid6_place table[0];
+};
 
-	u64 position;
-	u64 i, Y;
+// Sector and device mapping callback
+static void algorithm_raid6(struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity)
+{
+	struct raid6_data *data = ctx->alg_data;
+	struct raid6_place *place;
 
-	u64 data_block; // Data block number
-	u64 local_gap;	// Parity blocks skipped in current lane
 	u64 lane;
 	u64 block_start, block_offset;
+	u32 index;
+
+	// Data block number -> period number and index inside period
+	lane = *device_number + block * ctx->ndev;
+	index = insane_div(lane, &data->period);
+	place = &data->table[index];
+
+	lane = lane * ctx->ndev + place->lane;
+
+	*device_number = place->device;
+
+	// Get offset in block and remap sector
+	block_offset = *sector & (ctx->chunk_size - 1);
+	block_start = lane << ctx->chunk_size_shift;
+	*sector = block_start + block_offset;
+
+	if (!parity)
+		return;
+
+	// For sequential writing: let's check number of current block
+	parity->last_block = false;
+	if (ctx->io_pattern == SEQUENTIAL)
+		parity->last_block = place->last_block;
+
+	// Now it's time to count, where our syndromes are.
+	// Parities have same sector, different devices
+	parity->start_device = 0;
+	parity->start_sector = block_start;
+
+	parity->device_number[0] = place->parity[0];
+	parity->sector_number[0] = block_start;
+
+	parity->device_number[1] = place->parity[1];
+	parity->sector_number[1] = block_start;
+
+	parity->count = 2;
+
+	// Position inside lane, period index runs over lanes in order
+	parity->data_count = ctx->ndev - ctx->p_blocks;
+	parity->data_index = index - place->lane * parity->data_count;
+}
+
+static struct recover_stripe raid6_recover(struct insane_c *ctx, u64 block, int device_number) {
+    struct recover_stripe result;
+   
+    int block_place, counter, device, total_disks, chunk_size;
 
-	int block_size;
-	int total_disks;
+    u64 onotole;
+
+    total_disks = ctx->ndev;
+    chunk_size = ctx->chunk_size;
+
+    // place of block in current stripe
+    onotole = block + device_number;
+
+    block_place = sector_div(onotole ,total_disks);
+
+    // starting block
+    onotole = block;
+    device = sector_div(onotole, total_disks);
+    if (device != 0)
+        device = total_disks - device;
+    else
+        device = 0;
 
-	block_size = ctx->chunk_size;
-	total_disks = raid6_alg.ndisks;
+    counter = 0;
+    // we should read (total_disks - 2) blocks to recover
+    while (counter < total_disks - 2) {
+        if (device != device_number) {
+            result.read_sector[counter] = block * chunk_size;
+            result.read_device[counter] = device;
+            counter++;
+        }
+        device++;
+        onotole = sector_div(device, total_disks);
+	device = onotole;
+    }
 
-	data_block = *device_number + block * total_disks;
+    result.write_device = device_number;
+    result.write_sector = block * chunk_size;
 
-	lane = data_block;
-	position = sector_div(lane, total_disks - raid6_alg.p_blocks); 
+    result.quantity = total_disks - 2;
+    return result;
+}
 
-	i = lane;
-	Y = sector_div(i, total_disks);
+// Fill placement of data block number "position" in lane Y of the period
+static void raid6_fill_place(struct raid6_place *place, int total_disks, int position, int Y)
+{
+	int local_gap;	// Parity blocks skipped in current lane
 
 	local_gap = 2;
 
@@ -95,94 +188,49 @@ static struct parity_places algorithm_raid6(struct insane_c *ctx, u64 block, sec
 	if( position + Y < (total_disks - 2) )
 		local_gap = 0;
 
-	// Remap block accounting all gaps
-	position = data_block + local_gap + (2 * lane);
-
-	// Remap device number
-	*device_number = sector_div(position, total_disks);
-
-	// For sequential writing: let's check number of current block
-		parity.last_block = false;
-	if (ctx->io_pattern == SEQUENTIAL)
-	{
-		if (*device_number + (2 - local_gap) == (total_disks - 1))
-			parity.last_block = true;
-	}
+	place->device = position + local_gap;
+	place->lane = Y;
+	place->last_block = (place->device + (2 - local_gap) == (total_disks - 1));
 
-	// Get offset in block and remap sector
-	block_offset = sector_div(*sector, block_size);
-	block_start = position * block_size;
-	*sector = block_start + block_offset;
-
-	// Now it's time to count, where our syndromes are.
-	parity.start_device = 0;
-	parity.start_sector = block_start;
-	
-	// Parities have same sector, different devices
-	parity.sector_number[0] = block_start;
-	parity.sector_number[1] = block_start;
-
-	parity.device_number[1] = total_disks - 1 - Y;
+	place->parity[1] = total_disks - 1 - Y;
 	if( Y < total_disks - 1 )
-		parity.device_number[0] = parity.device_number[1] - 1;
+		place->parity[0] = place->parity[1] - 1;
 	 else
-		parity.device_number[0] = total_disks - 1;
-
-	parity.device_number[2] = -1;
-	return parity;
+		place->parity[0] = total_disks - 1;
 }
 
-static struct recover_stripe raid6_recover(struct insane_c *ctx, u64 block, int device_number) {
-    struct recover_stripe result;
-   
-    int block_place, counter, device, total_disks, chunk_size;
-
-    u64 onotole;
-
-    total_disks = raid6_alg.ndisks;
-    chunk_size = ctx->chunk_size;
+static int raid6_configure( struct insane_c *ctx )
+{
+	struct raid6_data *data;
+	int total_disks, data_disks;
+	int Y, position;
 
-    // place of block in current stripe
-    onotole = block + device_number;
+	if (!ctx)
+		return -EINVAL;
 
-    block_place = sector_div(onotole ,total_disks);
+	total_disks = ctx->ndev;
+	data_disks = total_disks - ctx->p_blocks;
+	if (data_disks < 1)
+		return -EINVAL;
 
-    // starting block
-    onotole = block;
-    device = sector_div(onotole, total_disks);
-    if (device != 0)
-        device = total_disks - device;
-    else
-        device = 0;
+	data = kmalloc(sizeof(*data) + sizeof(data->table[0]) * total_disks * data_disks, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
 
-    counter = 0;
-    // we should read (total_disks - 2) blocks to recover
-    while (counter < total_disks - 2) {
-        if (device != device_number) {
-            result.read_sector[counter] = block * chunk_size;
-            result.read_device[counter] = device;
-            counter++;
-        }
-        device++;
-        onotole = sector_div(device, total_disks);
-	device = onotole;
-    }
+	for (Y = 0; Y < total_disks; Y++)
+		for (position = 0; position < data_disks; position++)
+			raid6_fill_place(&data->table[Y * data_disks + position], total_disks, position, Y);
 
-    result.write_device = device_number;
-    result.write_sector = block * chunk_size;
+	insane_div_init(&data->period, total_disks * data_disks);
 
-    result.quantity = total_disks - 2;
-    return result;
+	ctx->alg_data = data;
+	ctx->stripe_blocks = ctx->ndev;
+	return 0;
 }
 
-static int raid6_configure( struct insane_c *ctx )
+static void raid6_destroy( struct insane_c *ctx )
 {
-	if (!ctx)
-		return -EINVAL;
-
-	raid6_alg.ndisks = ctx->ndev;
-	raid6_alg.stripe_blocks = ctx->ndev;
-	return 0;
+	kfree(ctx->alg_data);
 }
 
 static int __init insane_raid6_init( void )
@@ -1,9 +1,11 @@
 #include <linux/module.h>
 #include <linux/device-mapper.h>
+#include <linux/slab.h>
 #include "insane.h"
 
-static struct parity_places algorithm_raid6e( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number );
+static void algorithm_raid6e( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity );
 static int raid6e_configure( struct insane_c *ctx );
+static void raid6e_destroy( struct insane_c *ctx );
 static struct recover_stripe raid6e_recover(struct insane_c *ctx, u64 block, int device_number);
 
 #define DEGRADED_DISK 1
@@ -14,7 +16,9 @@ struct insane_algorithm raid6e_alg = {
 	.e_blocks = 1,
 	.map = algorithm_raid6e,
 	.configure = raid6e_configure,
+	.destroy = raid6e_destroy,
         .recover = raid6e_recover,
+	.pq = true,
 	.module = THIS_MODULE
 };
 
@@ -23,8 +27,15 @@ struct block_place {
 	int device_number;
 };
 
-static struct block_place get_degraded_block(u64 block, int total_disks, int block_size, u64 device_length)
+// Per-device data, ctx->alg_data
+struct raid6e_data {
+	struct insane_divisor lane;  // ndisks - p_blocks, blocks of data in lane
+	struct insane_divisor spare; // ndisks - 1, devices except degraded one
+};
+
+static struct block_place get_degraded_block(struct insane_c *ctx, u64 block)
 {
+	struct raid6e_data *data = ctx->alg_data;
 	struct block_place degraded_place;
 	u64 block_pos;
 	u64 empty_zone_offset;
@@ -32,22 +43,22 @@ static struct block_place get_degraded_block(u64 block, int total_disks, int blo
 	block_pos = block;
 
 	// Let's count device number in empty zone
-	degraded_place.device_number = sector_div(block_pos, (total_disks - 1)); 
+	degraded_place.device_number = insane_div(block_pos, &data->spare);
 	// Little fix
 	if (degraded_place.device_number >= DEGRADED_DISK)
 		degraded_place.device_number++;
 	
 	// Now let's count sector number in empty_zone. 
 	// First of all, we should count empty_zone_offset.
-	empty_zone_offset = device_length;
+	empty_zone_offset = ctx->ti->len;
 
-	// p_blocks + e_block = 3.
-	sector_div(empty_zone_offset, (total_disks - 3)); 
+	// p_blocks + e_block = 3, so it is data_div.
+	insane_div(empty_zone_offset, &ctx->data_div);
 	// Now empty_zone_offset == one real disk capacity (including empty and parity)
 
-	sector_div(empty_zone_offset, total_disks); // Almost ready.
+	insane_div(empty_zone_offset, &ctx->ndev_div); // Almost ready.
 
-	degraded_place.sector = empty_zone_offset + block_pos * block_size;
+	degraded_place.sector = empty_zone_offset + (block_pos << ctx->chunk_size_shift);
 	
 	return degraded_place;
 }
@@ -55,9 +66,9 @@ static struct block_place get_degraded_block(u64 block, int total_disks, int blo
 /*
  * Algorithm of RAID6E with degraded drive
  */
-static struct parity_places algorithm_raid6e( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number)
+static void algorithm_raid6e( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity)
 {
-	struct parity_places parity;
+	struct raid6e_data *data = ctx->alg_data;
 	struct block_place degraded_place;
 
 	u64 i, Y;
@@ -67,24 +78,25 @@ static struct parity_places algorithm_raid6e( struct insane_c *ctx, u64 block, s
 	u64 data_block;
 	u64 lane;
 	u64 block_offset, block_start;
+	int data_index;
 
 	int block_size;
 	int total_disks;
-	sector_t device_length;
+	bool last_block;
 
 	
 	block_size = ctx->chunk_size;
-	total_disks = raid6e_alg.ndisks;
-	device_length = ctx->ti->len;
+	total_disks = ctx->ndev;
 	
 	data_block = *device_number + block * total_disks;
 	lane = data_block;
 
 	// NORMAL SITUATION
 	// Everything like in RAID 6
-	position = sector_div(lane, total_disks - raid6e_alg.p_blocks); 
+	position = insane_div(lane, &data->lane);
+	data_index = position;
 	i = lane;
-	Y = sector_div(i, total_disks);
+	Y = insane_div(i, &ctx->ndev_div);
  
 	local_gap = 2;
 
@@ -94,77 +106,78 @@ static struct parity_places algorithm_raid6e( struct insane_c *ctx, u64 block, s
 
 	// If we didn't cross square diagonal then we don't skip syndromes in
 	// current lane
-	if (position + Y < (total_disks - raid6e_alg.p_blocks))
+	if (position + Y < (total_disks - ctx->p_blocks))
 		local_gap = 0;
 
 	// Remap block accounting all gaps
-	position = data_block + local_gap + (raid6e_alg.p_blocks * lane);
+	position = data_block + local_gap + (ctx->p_blocks * lane);
 		
 	// Remap device_number
-	*device_number = sector_div(position, total_disks);
+	*device_number = insane_div(position, &ctx->ndev_div);
 
 	// For sequential writing: let's check number of current block
-	parity.last_block = false;
-	if (ctx->io_pattern == SEQUENTIAL)
-	{
-		if (*device_number + (2 - local_gap) == (total_disks - 1))
-			parity.last_block = true;
-	}
+	last_block = (*device_number + (2 - local_gap) == (total_disks - 1));
 	
 	// Get offset in block and remap sector
-	block_offset = sector_div(*sector, block_size);
+	block_offset = *sector & (block_size - 1);
 	block_start = position * block_size;
 	*sector = position * block_size + i;
+
+	if (*device_number == DEGRADED_DISK) {
+		degraded_place = get_degraded_block(ctx, position);
+		*device_number = degraded_place.device_number;
+		*sector = degraded_place.sector + i;
+	}
+
+	if (!parity)
+		return;
+
+	parity->last_block = false;
+	if (ctx->io_pattern == SEQUENTIAL)
+		parity->last_block = last_block;
+
+	parity->data_index = data_index;
+	parity->data_count = total_disks - ctx->p_blocks;
 	
 	// Now it's time to count, where our syndromes are
 
-	parity.start_device = 0;
-	parity.start_sector = block_start; 
+	parity->start_device = 0;
+	parity->start_sector = block_start; 
 	
-	parity.sector_number[0] = block_start;
-	parity.sector_number[1] = block_start;
+	parity->sector_number[0] = block_start;
+	parity->sector_number[1] = block_start;
 	
-	parity.device_number[1] = total_disks - 1 - Y;
+	parity->device_number[1] = total_disks - 1 - Y;
 
 	if (Y < total_disks - 1)
-		parity.device_number[0] = parity.device_number[1] - 1;
+		parity->device_number[0] = parity->device_number[1] - 1;
 	else
-		parity.device_number[0] = total_disks - 1;
+		parity->device_number[0] = total_disks - 1;
 
-	if (*device_number == DEGRADED_DISK) {
-		degraded_place = get_degraded_block(position, total_disks, block_size, device_length);
-		*device_number = degraded_place.device_number;
-		*sector = degraded_place.sector + i;
+	// Data and syndromes of one lane are on different devices
+	if (parity->device_number[0] == DEGRADED_DISK) {
+		degraded_place = get_degraded_block(ctx, position);
+		parity->device_number[0] = degraded_place.device_number;
+		parity->sector_number[0] = degraded_place.sector;
 	}
-	else if (parity.device_number[0] == DEGRADED_DISK) {
-		degraded_place = get_degraded_block(position, total_disks, block_size, device_length);
-		parity.device_number[0] = degraded_place.device_number;
-		parity.sector_number[0] = degraded_place.sector;
-	}
-	else if (parity.device_number[1] == DEGRADED_DISK) {
-		degraded_place = get_degraded_block(position, total_disks, block_size, device_length);
-		parity.device_number[1] = degraded_place.device_number;
-		parity.sector_number[1] = degraded_place.sector;
+	else if (parity->device_number[1] == DEGRADED_DISK) {
+		degraded_place = get_degraded_block(ctx, position);
+		parity->device_number[1] = degraded_place.device_number;
+		parity->sector_number[1] = degraded_place.sector;
 	}
 
-	parity.device_number[2] = -1;
-	return parity;
+	parity->count = 2;
 }
 
 static struct recover_stripe raid6e_recover(struct insane_c *ctx, u64 block, int device_number) {
     struct recover_stripe result;
     struct block_place read_place;
 
-    int total_disks, chunk_size;
-    u64 position, device_length;
-
-    total_disks = raid6e_alg.ndisks;
-    chunk_size = ctx->chunk_size;
-    device_length = ctx->ti->len;
+    u64 position;
 
-    position = total_disks * block + device_number;
+    position = ctx->ndev * block + device_number;
 
-    read_place = get_degraded_block(position, total_disks, chunk_size, device_length);
+    read_place = get_degraded_block(ctx, position);
 
     result.read_sector[0] = read_place.sector;
     result.read_device[0] = read_place.device_number;
@@ -177,14 +190,34 @@ static struct recover_stripe raid6e_recover(struct insane_c *ctx, u64 block, int
 
 static int raid6e_configure( struct insane_c *ctx )
 {
+	struct raid6e_data *data;
+
 	if (!ctx)
 		return -EINVAL;
 
-	raid6e_alg.ndisks = ctx->ndev;
-	raid6e_alg.stripe_blocks = ctx->ndev;	 
+	if (ctx->ndev <= ctx->p_blocks + ctx->e_blocks)
+		return -EINVAL;
+
+	data = kmalloc(sizeof(*data), GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	insane_div_init(&data->lane, ctx->ndev - ctx->p_blocks);
+	insane_div_init(&data->spare, ctx->ndev - 1);
+
+	ctx->alg_data = data;
+	ctx->stripe_blocks = ctx->ndev;
+
+	// P and Q rows hold ndev - p_blocks data blocks, not stripe data blocks
+	ctx->group_blocks = ctx->ndev - ctx->p_blocks;
 	return 0;
 }
 
+static void raid6e_destroy( struct insane_c *ctx )
+{
+	kfree(ctx->alg_data);
+}
+
 static int __init insane_raid6e_init( void )
 {
 	int r;
@@ -1,8 +1,10 @@
 #include <linux/module.h>
+#include <linux/slab.h>
 #include "insane.h"
 
-static struct parity_places algorithm_raid7( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number );
+static void algorithm_raid7( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity );
 static int raid7_configure( struct insane_c *ctx );
+static void raid7_destroy( struct insane_c *ctx );
 static struct recover_stripe raid7_recover(struct insane_c *ctx, u64 block, int device_number);
 
 struct insane_algorithm raid7_alg = {
@@ -11,90 +13,81 @@ struct insane_algorithm raid7_alg = {
 	.e_blocks = 0,
 	.map = algorithm_raid7,
 	.configure = raid7_configure,
+	.destroy = raid7_destroy,
         .recover = raid7_recover,
+	.gf = true,
 	.module = THIS_MODULE
 };
 
-static struct parity_places algorithm_raid7(struct insane_c *ctx, u64 block, sector_t *sector, int *device_number)
+// Placement of one data block inside the layout period.
+// The layout repeats every ndisks lanes, so the whole period
+// (ndisks lanes of ndisks - 3 data blocks) is precomputed in configure.
+struct raid7_place
 {
-	u64 position;
+	u16  device;     // Member holding the data block
+	u16  lane;       // Lane offset inside the period
+	u16  parity[3];  // Syndrome members of that lane
+	bool last_block; // Last data block of the lane
+};
 
-	u64 i, Y;
+// Per-device layout, ctx->alg_data
+struct raid7_data
+{
+	struct insane_divisor period; // Data blocks in one period
+	struct insane_gf_code *code;  // Cauchy code of 3 syndromes
+	struct raid7_place table[0];
+};
+
+static void algorithm_raid7(struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity)
+{
+	struct raid7_data *data = ctx->alg_data;
+	struct raid7_place *place;
 
-	u64 data_block; //Data block number
-	u64 local_gap;
 	u64 lane;
 	u64 block_start, block_offset;
+	u32 index;
+	int i, position;
 
-	int block_size;
-	int total_disks;
+	// Data block number -> period number and index inside period
+	lane = *device_number + block * ctx->ndev;
+	index = insane_div(lane, &data->period);
+	place = &data->table[index];
 
-	struct parity_places parity;
+	lane = lane * ctx->ndev + place->lane;
 
-	block_size = ctx->chunk_size;
-	total_disks = raid7_alg.ndisks;
+	*device_number = place->device;
 
-	data_block = *device_number + block * total_disks;
-
-	lane = data_block;
-	position = sector_div(lane, total_disks - raid7_alg.p_blocks); 
-
-	i = lane;
-	Y = sector_div(i, total_disks);
-	
-	local_gap = 3;
-
-	if (Y == (total_disks - 1))
-		local_gap = 1;
+	block_offset = *sector & (ctx->chunk_size - 1);
+	block_start = lane << ctx->chunk_size_shift;
+	*sector = block_start + block_offset;
 
-	if (Y == (total_disks - 2))
-		local_gap = 2;
+	if (!parity)
+		return;
 
-	if ((position + Y) < (total_disks - 3))
-		local_gap = 0;
+	// For sequential writing: let's check number of current block
+	parity->last_block = false;
+	if (ctx->io_pattern == SEQUENTIAL)
+		parity->last_block = place->last_block;
 
-	position = data_block + local_gap + (3 * lane);
-	
-	*device_number = sector_div(position, total_disks);
+	// Now it's time to count, where our syndromes are.
+	// Parities have same sector, different devices
+	parity->start_device = 0;
+	parity->start_sector = block_start;
 
-	block_offset = sector_div(*sector, block_size);
-	block_start = position * block_size;
-	*sector = block_start + block_offset;
+	parity->device_number[0] = place->parity[0];
+	parity->sector_number[0] = block_start;
 
-	parity.last_block = false;
-	if (ctx->io_pattern == SEQUENTIAL)
-	{
-		if (*device_number + (3 - local_gap) == (total_disks - 1))
-			parity.last_block = true;
-	}
+	parity->device_number[1] = place->parity[1];
+	parity->sector_number[1] = block_start;
 
-	// Time to count parity places
-	
-	parity.start_device = 0;
-	parity.start_sector = block_start;
-	
-	parity.sector_number[0] = block_start;
-	parity.sector_number[1] = block_start;
-	parity.sector_number[2] = block_start;
+	parity->device_number[2] = place->parity[2];
+	parity->sector_number[2] = block_start;
 
-	parity.device_number[2] = total_disks - 1 - Y;
-	
-	if (Y == (total_disks - 1)) {
-		parity.device_number[1] = total_disks - 1;
-		parity.device_number[0] = total_disks - 2;
-	}
-	else if (Y == (total_disks - 2)) {
-		parity.device_number[1] = 0;
-		parity.device_number[0] = total_disks - 1;
-	}
-	else {
-		parity.device_number[1] = parity.device_number[2] - 1;
-		parity.device_number[0] = parity.device_number[2] - 2;
-	}
+	parity->count = 3;
 
-	parity.device_number[3] = -1;
-	
-	return parity;
+	position = index - place->lane * data->code->k;
+	for (i = 0; i < 3; i++)
+		parity->coef[i] = data->code->matrix[i * data->code->k + position];
 }
 
 static struct recover_stripe raid7_recover(struct insane_c *ctx, u64 block, int device_number) {
@@ -104,7 +97,7 @@ static struct recover_stripe raid7_recover(struct insane_c *ctx, u64 block, int
     
     u64 onotole;
 
-    total_disks = raid7_alg.ndisks;
+    total_disks = ctx->ndev;
     chunk_size = ctx->chunk_size;
 
     // place of block in current stripe
@@ -140,16 +133,85 @@ static struct recover_stripe raid7_recover(struct insane_c *ctx, u64 block, int
     return result;
 }
 
+// Fill placement of data block number "position" in lane Y of the period
+static void raid7_fill_place(struct raid7_place *place, int total_disks, int position, int Y)
+{
+	int local_gap;
+
+	local_gap = 3;
+
+	if (Y == (total_disks - 1))
+		local_gap = 1;
+
+	if (Y == (total_disks - 2))
+		local_gap = 2;
+
+	if ((position + Y) < (total_disks - 3))
+		local_gap = 0;
+
+	place->device = position + local_gap;
+	place->lane = Y;
+	place->last_block = (place->device + (3 - local_gap) == (total_disks - 1));
+
+	place->parity[2] = total_disks - 1 - Y;
+	
+	if (Y == (total_disks - 1)) {
+		place->parity[1] = total_disks - 1;
+		place->parity[0] = total_disks - 2;
+	}
+	else if (Y == (total_disks - 2)) {
+		place->parity[1] = 0;
+		place->parity[0] = total_disks - 1;
+	}
+	else {
+		place->parity[1] = place->parity[2] - 1;
+		place->parity[0] = place->parity[2] - 2;
+	}
+}
+
 static int raid7_configure( struct insane_c *ctx )
 {
+	struct raid7_data *data;
+	int total_disks, data_disks;
+	int Y, position;
+
 	if (!ctx)
 		return -EINVAL;
 
-	raid7_alg.ndisks = ctx->ndev;
-	raid7_alg.stripe_blocks = ctx->ndev;    
+	total_disks = ctx->ndev;
+	data_disks = total_disks - ctx->p_blocks;
+	if (data_disks < 1)
+		return -EINVAL;
+
+	data = kmalloc(sizeof(*data) + sizeof(data->table[0]) * total_disks * data_disks, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	for (Y = 0; Y < total_disks; Y++)
+		for (position = 0; position < data_disks; position++)
+			raid7_fill_place(&data->table[Y * data_disks + position], total_disks, position, Y);
+
+	data->code = insane_gf_code_create(data_disks, ctx->p_blocks);
+	if (!data->code) {
+		kfree(data);
+		return -ENOMEM;
+	}
+
+	insane_div_init(&data->period, total_disks * data_disks);
+
+	ctx->alg_data = data;
+	ctx->stripe_blocks = ctx->ndev;
 	return 0;
 }
 
+static void raid7_destroy( struct insane_c *ctx )
+{
+	struct raid7_data *data = ctx->alg_data;
+
+	insane_gf_code_free(data->code);
+	kfree(ctx->alg_data);
+}
+
 static int __init insane_raid7_init( void )
 {
 	int r;
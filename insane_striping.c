@@ -12,6 +12,14 @@
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/gfp.h>
+#include <linux/percpu.h>
+#include <linux/mempool.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
+#include <linux/ioprio.h>
+#include <linux/highmem.h>
+#include <linux/raid/pq.h>
+#include <linux/raid/xor.h>
 
 #include <linux/device-mapper.h>
 
@@ -19,14 +27,73 @@
 
 #include "insane.h"
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION( 2, 6, 39 )
+// No on-stack plugging, queues are unplugged by themselves
+struct blk_plug {};
+static inline void blk_start_plug(struct blk_plug *plug) {}
+static inline void blk_finish_plug(struct blk_plug *plug) {}
+#endif
+
 // Driver parameter
 int debug = 0;
 
+// Emulated parity and rebuild I/O data is never used, so by default it
+// carries no payload: writes use shared zero page (or REQ_WRITE_SAME if
+// member supports it) and reads land in sink page.
+// payload = 1 allocates page for every bvec as before.
+int payload = 0;
+// Sink pages are shared by concurrent reads on purpose, their data is
+// never used. There is one per CPU only to spread DMA writes to them,
+// it is not owned by the CPU.
+static DEFINE_PER_CPU(struct page *, insane_sink);
+
+// Latency-faithful mode: frontend write is completed only when its
+// emulated parity I/O is done, so measured latency includes parity penalty.
+int wait_parity = 0;
+
+// Random writes go through ordered read-modify-write: old data and parity
+// are read first, parity and data are written when the reads are done.
+int ordered_rmw = 0;
+
+// Parity I/O of mapped writes is queued on per-CPU lock-free lists and
+// submitted by workers of the same CPU, so map path only remaps and
+// enqueues. Needs llist (3.2+), ignored on older kernels.
+int defer_parity = 0;
+
+// Emulated parity and rebuild I/O in flight per member, in bios and
+// kilobytes (0 - unlimited). Submitter waits when member is over limit.
+int max_inflight = 64;
+int max_inflight_kb = 16384;
+
+// I/O priority class of emulated parity and rebuild I/O, lowest level
+// of the class is used. 0 keeps priority of submitter.
+int parity_ioprio = IOPRIO_CLASS_IDLE;
+
+// Adaptive io_pattern: partially written stripe of stream idle for
+// stream_timeout milliseconds gets its parity by read-modify-write.
+int stream_timeout = 100;
+
+// P+Q algorithms (raid6, raid6e) compute real P and Q of written data
+// by read-modify-write instead of emulating parity I/O. GF(2^8)
+// algorithms (raid7, LRC) compute their syndromes with insane_gf.
+int compute = 0;
+
+// Write-back stripe cache: entries per target (0 - off, read on device
+// creation). Random writes of cached stripe share one parity update,
+// stripe idle for cache_timeout milliseconds is flushed.
+int stripe_cache = 0;
+int cache_timeout = 1000;
+
+// Parity of partially written stripe is updated by reconstruct-write
+// (clean data is read) when it needs fewer member I/Os than
+// read-modify-write. 0 - always read-modify-write.
+int reconstruct_write = 1;
+
 // List of RAID algorithms
 LIST_HEAD(alg_list);
 DEFINE_SPINLOCK(alg_list_lock);
 
-static void do_bio( sector_t sector, struct block_device *bdev, int bi_size, int bi_vcnt, int rw );
+static void do_bio( struct insane_c *sc, struct insane_io *io, sector_t sector, int device, int bi_size, int rw );
 /*
  * An event is triggered whenever a drive drops out of a stripe volume.
  */
@@ -49,11 +116,254 @@ static inline struct insane_c *alloc_context(unsigned int ndev)
 	return kmalloc(len, GFP_KERNEL);
 }
 
+// Reserve of emulated and rebuild I/O: bios for INSANE_MIN_IOS writes in
+// flight, each of them issues up to 1 + 2 * p_blocks chunk bios of up to
+// BIO_MAX_PAGES pages. Pages are reserved for the largest single user:
+// one such bio, or the buffers of one compute mode write. Either is taken
+// from the pool at once (see insane_alloc_pages).
+#define INSANE_MIN_IOS 16
+
+#ifdef INSANE_DEFER_PARITY
+static void insane_defer_work(struct work_struct *work);
+
+// Per-CPU parity queues, allocated regardless of defer_parity
+// as it may be switched at runtime
+static int insane_create_defer(struct insane_c *sc)
+{
+	struct insane_cpu *cpu;
+	int i;
+
+	sc->defer_pool = mempool_create_kmalloc_pool(INSANE_MIN_IOS, sizeof(struct insane_defer));
+	if (!sc->defer_pool)
+		return -ENOMEM;
+
+	sc->cpu = alloc_percpu(struct insane_cpu);
+	if (!sc->cpu) {
+		mempool_destroy(sc->defer_pool);
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(i) {
+		cpu = per_cpu_ptr(sc->cpu, i);
+		cpu->sc = sc;
+		init_llist_head(&cpu->list);
+		INIT_WORK(&cpu->work, insane_defer_work);
+	}
+
+	return 0;
+}
+#endif
+
+static void insane_stream_timeout(struct work_struct *work);
+
+static int insane_create_streams(struct insane_c *sc)
+{
+	sc->streams = kzalloc(sizeof(struct insane_stream) * INSANE_STREAMS, GFP_KERNEL);
+	if (!sc->streams)
+		return -ENOMEM;
+
+	spin_lock_init(&sc->stream_lock);
+	INIT_DELAYED_WORK(&sc->stream_work, insane_stream_timeout);
+	return 0;
+}
+
+static void insane_stripe_timeout(struct work_struct *work);
+static int insane_create_cover(struct insane_c *sc);
+
+static int insane_create_stripes(struct insane_c *sc)
+{
+	unsigned int i;
+	size_t size;
+
+	sc->stripe_hash_bits = ilog2(roundup_pow_of_two(stripe_cache)) + 1; // 2 buckets per entry
+	sc->nr_stripes = stripe_cache;
+
+	size = sizeof(struct insane_stripe) * sc->nr_stripes +
+	       sizeof(struct hlist_head) * (1 << sc->stripe_hash_bits);
+	sc->stripes = vmalloc(size);
+	if (!sc->stripes)
+		return -ENOMEM;
+	memset(sc->stripes, 0, size);
+	sc->stripe_hash = (struct hlist_head *)(sc->stripes + sc->nr_stripes);
+
+	INIT_LIST_HEAD(&sc->stripe_lru);
+	for (i = 0; i < sc->nr_stripes; i++) {
+		INIT_HLIST_NODE(&sc->stripes[i].hash);
+		list_add_tail(&sc->stripes[i].lru, &sc->stripe_lru);
+	}
+	for (i = 0; i < (1 << sc->stripe_hash_bits); i++)
+		INIT_HLIST_HEAD(&sc->stripe_hash[i]);
+
+	spin_lock_init(&sc->stripe_lock);
+	INIT_DELAYED_WORK(&sc->stripe_work, insane_stripe_timeout);
+	return 0;
+}
+
+// Pages of compute mode write: old data, syndromes and two scratch pages
+static inline unsigned int insane_pq_count( unsigned int nr_syndromes, unsigned int nr_pages )
+{
+	return (nr_syndromes + 1) * nr_pages + 2;
+}
+
+static int insane_create_pools(struct insane_c *sc)
+{
+	unsigned int splits, bios, pages, pq_pages, i;
+
+	splits = DIV_ROUND_UP(sc->chunk_size_pages, BIO_MAX_PAGES);
+	bios = INSANE_MIN_IOS * (1 + 2 * sc->p_blocks) * max_t(unsigned int, splits, 1);
+	pages = min_t(unsigned int, max_t(unsigned int, sc->chunk_size_pages, 1), BIO_MAX_PAGES);
+
+	// Largest compute mode write: one chunk, P+Q or all syndromes
+	pq_pages = insane_pq_count(max_t(unsigned int, sc->p_blocks, 2),
+				   max_t(unsigned int, sc->chunk_size_pages, 1));
+	if (sc->alg->pq || sc->alg->gf)
+		pages = max_t(unsigned int, pages, pq_pages);
+
+	sc->bs = bioset_create(bios, sizeof(struct insane_bio_info));
+	if (!sc->bs)
+		return -ENOMEM;
+
+	sc->page_pool = mempool_create_page_pool(pages, 0);
+	if (!sc->page_pool) {
+		bioset_free(sc->bs);
+		return -ENOMEM;
+	}
+	mutex_init(&sc->page_lock);
+
+	sc->io_pool = mempool_create_kmalloc_pool(INSANE_MIN_IOS, sizeof(struct insane_io));
+	if (!sc->io_pool) {
+		mempool_destroy(sc->page_pool);
+		bioset_free(sc->bs);
+		return -ENOMEM;
+	}
+
+	// Compute mode buffers descriptors, see insane_pq_alloc
+	sc->pq_pool = NULL;
+	if (sc->alg->pq || sc->alg->gf) {
+		sc->pq_pool = mempool_create_kmalloc_pool(INSANE_MIN_IOS, sizeof(struct insane_pq) +
+							  sizeof(struct page *) * pq_pages +
+							  sizeof(void *) * max_t(unsigned int, sc->ndev, sc->p_blocks));
+		if (!sc->pq_pool) {
+			mempool_destroy(sc->io_pool);
+			mempool_destroy(sc->page_pool);
+			bioset_free(sc->bs);
+			return -ENOMEM;
+		}
+	}
+
+	// Emulated I/O submitted from completions, it must progress on reclaim
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 2, 6, 37 )
+	sc->wq = alloc_workqueue("insane", WQ_MEM_RECLAIM, 0);
+#else
+	sc->wq = create_workqueue("insane");
+#endif
+	if (!sc->wq) {
+		if (sc->pq_pool)
+			mempool_destroy(sc->pq_pool);
+		mempool_destroy(sc->io_pool);
+		mempool_destroy(sc->page_pool);
+		bioset_free(sc->bs);
+		return -ENOMEM;
+	}
+
+#ifdef INSANE_DEFER_PARITY
+	if (insane_create_defer(sc)) {
+		destroy_workqueue(sc->wq);
+		if (sc->pq_pool)
+			mempool_destroy(sc->pq_pool);
+		mempool_destroy(sc->io_pool);
+		mempool_destroy(sc->page_pool);
+		bioset_free(sc->bs);
+		return -ENOMEM;
+	}
+#endif
+
+	sc->group_cover = NULL;
+	sc->streams = NULL;
+	sc->stripes = NULL;
+	if ((!sc->alg->pq && insane_create_cover(sc)) ||
+	    (sc->io_pattern == ADAPTIVE && insane_create_streams(sc)) ||
+	    (stripe_cache > 0 && insane_create_stripes(sc))) {
+		vfree(sc->group_cover);
+		kfree(sc->streams);
+#ifdef INSANE_DEFER_PARITY
+		free_percpu(sc->cpu);
+		mempool_destroy(sc->defer_pool);
+#endif
+		destroy_workqueue(sc->wq);
+		if (sc->pq_pool)
+			mempool_destroy(sc->pq_pool);
+		mempool_destroy(sc->io_pool);
+		mempool_destroy(sc->page_pool);
+		bioset_free(sc->bs);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < INSANE_STRIPE_LOCKS; i++) {
+		atomic_set(&sc->locks[i].count, 0);
+		spin_lock_init(&sc->locks[i].lock);
+		sc->locks[i].handoff = false;
+		bio_list_init(&sc->locks[i].waiting);
+	}
+
+	atomic_set(&sc->io_pending, 0);
+	atomic64_set(&sc->full_writes, 0);
+	atomic64_set(&sc->rcw_writes, 0);
+	atomic64_set(&sc->rmw_writes, 0);
+	init_waitqueue_head(&sc->io_wait);
+	init_waitqueue_head(&sc->throttle_wait);
+	return 0;
+}
+
+// Emulated I/O is not tracked by device mapper,
+// so wait for it before pools and devices are gone.
+static void insane_destroy_pools(struct insane_c *sc)
+{
+	// Partial stripes left in streams are dropped
+	if (sc->streams) {
+		cancel_delayed_work_sync(&sc->stream_work);
+		kfree(sc->streams);
+	}
+
+	// So are dirty stripes of stripe cache, parity is emulated
+	if (sc->stripes) {
+		cancel_delayed_work_sync(&sc->stripe_work);
+		vfree(sc->stripes);
+	}
+	vfree(sc->group_cover);
+
+	// Deferred parity work is counted in io_pending too
+	wait_event(sc->io_wait, !atomic_read(&sc->io_pending));
+	destroy_workqueue(sc->wq);
+#ifdef INSANE_DEFER_PARITY
+	free_percpu(sc->cpu);
+	mempool_destroy(sc->defer_pool);
+#endif
+	if (sc->pq_pool)
+		mempool_destroy(sc->pq_pool);
+	mempool_destroy(sc->io_pool);
+	mempool_destroy(sc->page_pool);
+	bioset_free(sc->bs);
+}
+
+// Free per-context algorithm data allocated by configure
+static void insane_release_alg(struct insane_c *sc)
+{
+	if (sc->alg->destroy)
+		sc->alg->destroy(sc);
+	sc->alg_data = NULL;
+}
+
+// Blocks recovered per recover_range call
+#define INSANE_RECOVER_BATCH 64
+
 static void insane_recover(struct insane_c *ctx) {
-    struct recover_stripe read_blocks;
+    struct recover_stripe single, *batch, *read_blocks;
+    struct blk_plug plug;
 
     u64 i, blocks_quantity;
-    int j, device_number, bi_vcnt;
+    unsigned int n, count, batch_size;
+    int j, device_number;
     sector_t bi_size;
 
     unsigned long start_time, finish_time, difference;
@@ -65,21 +375,44 @@ static void insane_recover(struct insane_c *ctx) {
     device_number = ctx->recovering_disk;
 	
     bi_size = ctx->chunk_size_bytes;
-    bi_vcnt = ctx->chunk_size_pages;
+
+    // Batched recover shares stripe arithmetic between neighbour blocks
+    batch = &single;
+    batch_size = 1;
+    if (ctx->alg->recover_range) {
+        read_blocks = kmalloc(sizeof(*read_blocks) * INSANE_RECOVER_BATCH, GFP_KERNEL);
+        if (read_blocks) {
+            batch = read_blocks;
+            batch_size = INSANE_RECOVER_BATCH;
+        }
+    }
 
     do_gettimeofday(&tv);
     start_time = tv.tv_sec;
     
-    for (i = 0; i < blocks_quantity; i++) {
-
-        read_blocks = ctx->alg->recover(ctx, i, device_number);
-        for ( j = 0; j < read_blocks.quantity; j++) {
-            do_bio(read_blocks.read_sector[j], ctx->devs[read_blocks.read_device[j]].dev->bdev, bi_size, bi_vcnt, READ);
+    for (i = 0; i < blocks_quantity; i += count) {
+        count = min_t(u64, blocks_quantity - i, batch_size);
+
+        if (batch_size > 1)
+            ctx->alg->recover_range(ctx, i, device_number, count, batch);
+        else
+            *batch = ctx->alg->recover(ctx, i, device_number);
+
+        blk_start_plug(&plug);
+        for (n = 0; n < count; n++) {
+            read_blocks = &batch[n];
+            for ( j = 0; j < read_blocks->quantity; j++) {
+                do_bio(ctx, NULL, read_blocks->read_sector[j], read_blocks->read_device[j], bi_size, READ);
+            }
+            if (read_blocks->write_device != -1)  // may be it is empty block
+                do_bio(ctx, NULL, read_blocks->write_sector, read_blocks->write_device, bi_size, WRITE);
         }
-        if (read_blocks.write_device != -1)  // may be it is empty block
-            do_bio(read_blocks.write_sector, ctx->devs[read_blocks.write_device].dev->bdev, bi_size, bi_vcnt, WRITE);
+        blk_finish_plug(&plug);
     }
 
+    if (batch != &single)
+        kfree(batch);
+
     do_gettimeofday(&tv);
     finish_time = tv.tv_sec;
     difference = finish_time - start_time;
@@ -100,7 +433,7 @@ static int insane_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	struct insane_c *sc;
 	struct insane_algorithm *alg;
 	int found;
-	sector_t width;
+	sector_t width, data_sectors;
 	int ndev;
 	int chunk_size;
 	int io_pattern;
@@ -108,12 +441,18 @@ static int insane_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	int r = -ENXIO;
 	int i;
 	char *end;
+	char *alg_args;
 
 	if (argc < 5) {
 		ti->error = "Not enough arguments";
 		return -EINVAL;
 	}
 
+	// Algorithm may be given with its arguments: <name>:<args>
+	alg_args = strchr(argv[0], ':');
+	if (alg_args)
+		*alg_args++ = '\0';
+
 	found = 0;
 	spin_lock( &alg_list_lock );
 	list_for_each_entry( alg, &alg_list, list )
@@ -169,7 +508,7 @@ static int insane_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		return -EINVAL;
 	}
 
-        if ( io_pattern == IO_PATTERN_NUM - 1) { // recover mode
+        if ( io_pattern == RECOVER) { // recover mode
             i = 1;
             recovering = simple_strtoul( argv[4], &end, 10 ); // Why 10?
             if ( *end || !recovering) {
@@ -214,36 +553,73 @@ static int insane_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	sc->ndev = ndev;
 	sc->dev_width = width;
 
-	if (ndev & (ndev - 1))
-		sc->ndev_shift = -1;
-	else
-		sc->ndev_shift = __ffs(ndev);
+	insane_div_init(&sc->ndev_div, ndev);
 
 	sc->chunk_size = chunk_size;
 	sc->chunk_size_shift = __ffs(chunk_size);
 
-	// Configure algorithm
-	if (alg->configure && alg->configure(sc))
+	// Geometry defaults come from descriptor, configure may override them
+	// for this context. Descriptor itself is shared and never changed.
+	sc->alg = alg;
+	sc->alg_data = NULL;
+	sc->stripe_blocks = alg->stripe_blocks;
+	sc->p_blocks = alg->p_blocks;
+	sc->e_blocks = alg->e_blocks;
+	sc->group_blocks = 0;
+	sc->alg_args = alg_args;
+
+	// Configure algorithm, it cleans up after itself on failure
+	r = alg->configure ? alg->configure(sc) : 0;
+	if (r)
 	{
 		dm_log("Failed to configure algorithm runtime params\n");
+		ti->error = "Couldn't configure algorithm";
+		kfree(sc);
+		return r;
+	}
+	sc->alg_args = NULL; // table arguments are gone after ctr
+
+	if (!sc->group_blocks && sc->p_blocks + sc->e_blocks < sc->stripe_blocks)
+		sc->group_blocks = sc->stripe_blocks - sc->p_blocks - sc->e_blocks;
+
+	if (!sc->stripe_blocks || sc->p_blocks > MAX_SYNDROMES ||
+	    sc->p_blocks + sc->e_blocks >= sc->stripe_blocks ||
+	    !sc->group_blocks || sc->group_blocks > INSANE_STRIPE_UNITS)
+	{
+		ti->error = "Invalid algorithm geometry";
+		insane_release_alg(sc);
+		kfree(sc);
 		return -EINVAL;
 	}
-	sc->alg = alg;
+
+	insane_div_init(&sc->stripe_div, sc->stripe_blocks);
+	insane_div_init(&sc->data_div, sc->stripe_blocks - sc->p_blocks - sc->e_blocks);
+	insane_div_init(&sc->group_div, sc->group_blocks);
+
+	// Unit of stripe dirty bitmaps is a page, larger for wide stripes
+	data_sectors = (sector_t)sc->group_blocks << sc->chunk_size_shift;
+	sc->stripe_unit_shift = min_t(unsigned int, PAGE_SHIFT - SECTOR_SHIFT, sc->chunk_size_shift);
+	while ((data_sectors >> sc->stripe_unit_shift) > INSANE_STRIPE_UNITS)
+		sc->stripe_unit_shift++;
+	sc->stripe_units = data_sectors >> sc->stripe_unit_shift;
+
 	if (!try_module_get(sc->alg->module))
 	{
 		dm_log("Failed to get module reference\n");
+		insane_release_alg(sc);
+		kfree(sc);
 		return -EFAULT;
 	}
 
 	// Reduce device size to *addressable* LBAs only in data blocks 
 	// (excluding parity and empty)
 	dm_debug("Insane device original width is %llu\n", (u64)ti->len);
-	sector_div(ti->len, alg->stripe_blocks);
-	ti->len = ti->len * (alg->stripe_blocks - alg->e_blocks - alg->p_blocks);
+	sector_div(ti->len, sc->stripe_blocks);
+	ti->len = ti->len * (sc->stripe_blocks - sc->e_blocks - sc->p_blocks);
 
 	// Round to virtual stripe size in sectors.
-	sector_div(ti->len, (sc->ndev * chunk_size * alg->stripe_blocks));
-	ti->len = (ti->len * sc->ndev * chunk_size * alg->stripe_blocks);
+	sector_div(ti->len, (sc->ndev * chunk_size * sc->stripe_blocks));
+	ti->len = (ti->len * sc->ndev * chunk_size * sc->stripe_blocks);
 	dm_debug("Insane device new width is %llu\n", (u64)ti->len);
 	
 	sc->chunk_size_bytes = sc->chunk_size * 512;
@@ -256,7 +632,13 @@ static int insane_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION( 3, 6, 0 )
 	r = dm_set_target_max_io_len(ti, chunk_size);
 	if (r)
+	{
+		ti->error = "Couldn't set max I/O length";
+		insane_release_alg(sc);
+		module_put(sc->alg->module);
+		kfree(sc);
 		return r;
+	}
 #else
 	ti->split_io = chunk_size;
 #endif
@@ -279,6 +661,16 @@ static int insane_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 #endif
 #endif
 
+	r = insane_create_pools(sc);
+	if (r)
+	{
+		ti->error = "Couldn't create I/O pools";
+		insane_release_alg(sc);
+		module_put(sc->alg->module);
+		kfree(sc);
+		return r;
+	}
+
 	dm_debug("Opening devices\n");
 	argv += (4 + i);
 	for (i = 0; i < ndev; i++) 
@@ -290,10 +682,15 @@ static int insane_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 			{
 				dm_put_device(ti, sc->devs[i].dev);
 			}
+			insane_destroy_pools(sc);
+			insane_release_alg(sc);
+			module_put(sc->alg->module);
 			kfree(sc);
-			return r;
+			return -ENXIO;
 		}
 		atomic_set(&(sc->devs[i].error_count), 0);
+		atomic_set(&sc->devs[i].inflight, 0);
+		atomic_set(&sc->devs[i].inflight_bytes, 0);
 		dm_debug("Got device %s(%p)\n", argv[i], sc->devs[i].dev);
 	}
 
@@ -301,7 +698,7 @@ static int insane_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	dm_log("Insane constructor: %u devices, %lld device width, %u chunk size\n", 
 		sc->ndev, (u64)sc->dev_width, sc->chunk_size);
 
-        if ( io_pattern == IO_PATTERN_NUM - 1) { // recover mode
+        if ( io_pattern == RECOVER) { // recover mode
             insane_recover(sc);
         }
 	return 0;
@@ -313,9 +710,12 @@ static void insane_dtr(struct dm_target *ti)
 	unsigned int i;
 	struct insane_c *sc = (struct insane_c *) ti->private;
 
+	insane_destroy_pools(sc);
+
 	for (i = 0; i < sc->ndev; i++)
 		dm_put_device(ti, sc->devs[i].dev);
 
+	insane_release_alg(sc);
 	module_put(sc->alg->module);
 	flush_work(&sc->trigger_event);
 	kfree(sc);
@@ -328,7 +728,7 @@ static void insane_dtr(struct dm_target *ti)
 //
 // Input params:
 // * sc - context.
-// * sector - incoming sector.
+// * sector - incoming sector, relative to target start (dm_target_offset).
 //
 // Output params:
 // * block - block number in backend device.
@@ -336,7 +736,7 @@ static void insane_dtr(struct dm_target *ti)
 // * result - mapped sector on specific backend disk.
 static void insane_map_sector(struct insane_c *sc, sector_t sector, u64 *block, uint32_t *lane_off, sector_t *result)
 {
-	sector_t chunk = dm_target_offset(sc->ti, sector);
+	sector_t chunk = sector;
 	sector_t chunk_offset;
 	dm_debug("insane_map_sector: sector %lld, chung %lld\n", (u64)sector, (u64)chunk);
 	
@@ -347,19 +747,8 @@ static void insane_map_sector(struct insane_c *sc, sector_t sector, u64 *block,
 						 sc->chunk_size_shift, (u64)chunk_offset, (u64)chunk);
 	
 	// Get stripe number and stripe offset.
-	if (sc->ndev_shift < 0) 
-	{
-		*lane_off = sector_div(chunk, sc->ndev);
-		dm_debug("Stripes shift < 0 (%d), chunk = %lld, found lane_off = %u\n", 
-						 sc->ndev_shift, (u64)chunk, *lane_off);
-	}
-	else 
-	{
-		*lane_off = chunk & (sc->ndev - 1);
-		chunk >>= sc->ndev_shift;
-		dm_debug("Stripes shift >=0 (%d), chunk = %lld, found lane_off = %u\n",
-						 sc->ndev_shift, (u64)chunk, *lane_off);
-	}
+	*lane_off = insane_div(chunk, &sc->ndev_div);
+	dm_debug("chunk = %lld, found lane_off = %u\n", (u64)chunk, *lane_off);
 	
 	*block = chunk;
 
@@ -393,8 +782,8 @@ static int insane_map_range(struct insane_c *sc, struct bio *bio, uint32_t targe
 {
 	sector_t begin, end, from, to;
 
-	from = bio->bi_sector;
-	to	 = bio->bi_sector + bio_sectors(bio);
+	from = dm_target_offset(sc->ti, bio->bi_sector);
+	to	 = from + bio_sectors(bio);
 
 	insane_map_range_sector(sc, from , target_dev, &begin);
 	insane_map_range_sector(sc, to	 , target_dev, &end);
@@ -459,205 +848,1412 @@ static int insane_map_special(struct insane_c *sc, struct bio *bio
 	return DM_MAPIO_REMAPPED;
 }
 
-static void insane_bi_end_io( struct bio *bio, int err )
+static inline struct insane_bio_info *insane_bio_info( struct bio *bio )
 {
-	int i;
-	for( i = 0; i < bio->bi_vcnt; i++ )
-	{
-		__free_page(bio->bi_io_vec[i].bv_page);
+	return (struct insane_bio_info *)bio - 1;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION( 3, 7, 0 )
+// Older kernels don't remember bio_set of bio
+static void insane_bio_destructor( struct bio *bio )
+{
+	bio_free(bio, insane_bio_info(bio)->sc->bs);
+}
+#endif
+
+// All count pages or none: user never waits for the pool holding a part
+// of its reserve. With GFP_NOIO caller must hold page_lock, so waiters
+// don't split the reserve between them.
+static bool insane_alloc_pages( struct insane_c *sc, struct page **pages, unsigned int count, gfp_t gfp )
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		pages[i] = mempool_alloc(sc->page_pool, gfp);
+		if (!pages[i]) {
+			while (i--)
+				mempool_free(pages[i], sc->page_pool);
+			return false;
+		}
 	}
+	return true;
+}
 
-	bio_put(bio);
+static void insane_pq_free( struct insane_c *sc, struct insane_pq *pq )
+{
+	unsigned int i;
+
+	for (i = 0; i < insane_pq_count(pq->nr_syndromes, pq->nr_pages); i++)
+		mempool_free(pq->pages[i], sc->page_pool);
+	mempool_free(pq, sc->pq_pool);
 }
 
-static void insane_bio_split(sector_t sector, struct block_device *bdev, int split_number, int rw) 
+// Take lock of parity group (group_blocks data chunks) of frontend sector
+// for write io. Returns false if write is queued, io->work is queued when the lock
+// is passed to it.
+static bool insane_lock_stripe( struct insane_c *sc, struct insane_io *io, sector_t sector )
 {
-    int i;
-    sector_t new_sector;
-    for (i = 0; i < split_number; i++) {
-        new_sector = sector + i*2048;
-        do_bio(new_sector, bdev, 1048576, 256, rw);
-        // 1048576 bytes = 512 * 2048 bytes. We can do bio maximum on 2048 sectors :(
-        // 256 pages = 1048576(bytes) / 4096(bytes per page). 4096 - constant size of memory page in Linux
-    }
+	struct insane_lock *lock;
+	unsigned long flags;
+	bool taken;
+	u64 number;
+
+	number = sector >> sc->chunk_size_shift;
+	insane_div(number, &sc->group_div);
+	lock = &sc->locks[hash_64(number, INSANE_STRIPE_LOCKS_SHIFT)];
+	io->lock = lock;
+
+	if (atomic_inc_return(&lock->count) == 1)
+		return true;
+
+	spin_lock_irqsave(&lock->lock, flags);
+	taken = lock->handoff;
+	if (taken)
+		lock->handoff = false;
+	else
+		bio_list_add(&lock->waiting, io->bio);
+	spin_unlock_irqrestore(&lock->lock, flags);
+
+	return taken;
 }
 
-static void do_bio( sector_t sector, struct block_device *bdev, int bi_size, int bi_vcnt, int rw )
+// Pass lock to the first waiting write. Waiter counted but not queued
+// yet takes it by handoff.
+static void insane_unlock_stripe( struct insane_c *sc, struct insane_lock *lock )
 {
+	struct insane_io *io = NULL;
+	unsigned long flags;
 	struct bio *bio;
-	struct page *parity_page;
 
-	int page_counter;
+	if (atomic_dec_and_test(&lock->count))
+		return;
 
-        sector_t split_number;
-        
-        if (bi_vcnt > 256) {
-            split_number = bi_vcnt;
-            sector_div(split_number, 256);
-            insane_bio_split(sector, bdev, (int) split_number, rw);
-        } else {
-        
-    	    bio = bio_alloc(GFP_NOIO, bi_vcnt);
-    	    bio->bi_bdev = bdev;
-	    bio->bi_sector = sector;
-	    bio->bi_vcnt = bi_vcnt;
-	    bio->bi_size = bi_size;
-	    bio->bi_end_io = insane_bi_end_io;
-	    bio->bi_idx = 0;
-
-	    for (page_counter = 0; page_counter < bi_vcnt; page_counter++) 
-	    {
-		parity_page = alloc_page(GFP_KERNEL);
-		bio->bi_io_vec[page_counter].bv_len = PAGE_SIZE;
-		bio->bi_io_vec[page_counter].bv_page = parity_page;
-		bio->bi_io_vec[page_counter].bv_offset = 0;
-	    }
-        
-	    submit_bio(rw, bio);
-        }
+	spin_lock_irqsave(&lock->lock, flags);
+	bio = bio_list_pop(&lock->waiting);
+	if (bio)
+		io = bio->bi_private;
+	else
+		lock->handoff = true;
+	spin_unlock_irqrestore(&lock->lock, flags);
+
+	if (io)
+		queue_work(sc->wq, &io->work);
 }
 
-// Trace current LBA and submit syndrom update on stripe change.
-// Used on sequential write to prevent performance degrade.
-static void insane_seq_syndromes (struct bio *bio, struct parity_places *syndromes, struct insane_c *sc, int dev_index)
+// Frontend bio waiting for its parity is completed by the last of them
+static void insane_io_put( struct insane_io *io )
 {
-	sector_t sector_number, bi_size;
-	sector_t current_block, next_block;
-	int device_number, p_blocks, bi_vcnt;
+	struct bio *bio = io->bio;
+	int error;
 
-	int parity_counter;
+	if (!atomic_dec_and_test(&io->pending))
+		return;
 
-	current_block = bio->bi_sector;
-	sector_div(current_block, sc->chunk_size);
+	// Reads of read-modify-write are done. Writes need process context.
+	if (io->stage == INSANE_IO_READ) {
+		io->stage = INSANE_IO_WRITE;
+		queue_work(io->sc->wq, &io->work);
+		return;
+	}
 
-	next_block = bio->bi_sector + bio->bi_size;
-	sector_div(next_block, sc->chunk_size);
+	error = io->error;
+	bio->bi_end_io = io->bi_end_io;
+	bio->bi_private = io->bi_private;
+	if (io->pq)
+		insane_pq_free(io->sc, io->pq);
+	if (io->lock)
+		insane_unlock_stripe(io->sc, io->lock);
+	mempool_free(io, io->sc->io_pool);
 
-	if (current_block != next_block) {
+	bio_endio(bio, error);
+}
 
-		p_blocks = sc->alg->p_blocks;	
-		bi_vcnt = sc->chunk_size_pages;
-		bi_size = sc->chunk_size_bytes;
+static bool insane_may_issue( struct insane_dev *dev, unsigned int bytes )
+{
+	int count = atomic_read(&dev->inflight);
+
+	// Idle member takes bio of any size
+	if (!count)
+		return true;
+	if (max_inflight && count >= max_inflight)
+		return false;
+	if (max_inflight_kb && atomic_read(&dev->inflight_bytes) + bytes > (unsigned int)max_inflight_kb << 10)
+		return false;
+	return true;
+}
 
-		for (parity_counter = 0; parity_counter < p_blocks; parity_counter++)
-		{
-			device_number = syndromes->device_number[parity_counter];
-			sector_number = syndromes->sector_number[parity_counter];
-			do_bio( sector_number, sc->devs[device_number].dev->bdev, bi_size, bi_vcnt, WRITE );
-		}
-	}
+// Wait for member to drop below in-flight limit and account bio in it.
+// Bios already submitted inside generic_make_request (map path) are not
+// issued until it returns, so there submitter waits only for its first
+// bio and the limit may be exceeded by one write.
+static void insane_throttle( struct insane_c *sc, struct insane_dev *dev, unsigned int bytes )
+{
+	if (!current->bio_list || bio_list_empty(current->bio_list))
+		wait_event(sc->throttle_wait, insane_may_issue(dev, bytes));
 
-/*
-	static sector_t stripe_num = 0;
-	static sector_t stripe_sector = 0;
-	sector_t prev_stripe;
-	sector_t d_sectors, bio_size;
+	atomic_inc(&dev->inflight);
+	atomic_add(bytes, &dev->inflight_bytes);
+}
 
-	int p_blocks, bi_vcnt, bi_size;
-	int device_number;
-	sector_t sector_number;
-	int parity_counter;
+// Emulated and rebuild bios come from context bio_set, so they always make
+// progress under memory pressure. Front pad holds context and frontend io.
+static struct bio *insane_bio_alloc( struct insane_c *sc, struct insane_io *io, struct insane_dev *dev, int nr_vecs, unsigned int bytes )
+{
+	struct bio *bio;
 
-	p_blocks = sc->alg->p_blocks;
-	bi_vcnt  = sc->chunk_size_pages;
-	bi_size  = sc->chunk_size_bytes;
+	insane_throttle(sc, dev, bytes);
+
+	bio = bio_alloc_bioset(GFP_NOIO, nr_vecs, sc->bs);
+	insane_bio_info(bio)->sc = sc;
+	insane_bio_info(bio)->io = io;
+	insane_bio_info(bio)->dev = dev;
+	insane_bio_info(bio)->bytes = bytes;
+	if (parity_ioprio)
+		bio_set_prio(bio, IOPRIO_PRIO_VALUE(parity_ioprio, IOPRIO_BE_NR - 1));
+#if LINUX_VERSION_CODE < KERNEL_VERSION( 3, 7, 0 )
+	bio->bi_destructor = insane_bio_destructor;
+#endif
+	atomic_inc(&sc->io_pending);
+	if (io)
+		atomic_inc(&io->pending);
 
-	// Calculate stripe number
-	prev_stripe = stripe_num;
-	stripe_num = bio->bi_sector;
-	sector_div(stripe_num, sc->chunk_size);
-	stripe_num = (stripe_num * sc->ndev + dev_index);
-	sector_div(stripe_num, sc->alg->stripe_blocks);
+	return bio;
+}
 
-	// Update stripe sector
-	bio_size = bio->bi_size;
-	bio_size >>= SECTOR_SHIFT;
-	stripe_sector = stripe_sector + bio_size;
+static void insane_bio_put( struct bio *bio )
+{
+	struct insane_c *sc = insane_bio_info(bio)->sc;
+	struct insane_io *io = insane_bio_info(bio)->io;
+	struct insane_dev *dev = insane_bio_info(bio)->dev;
 
-	d_sectors = sc->chunk_size;
-	d_sectors = d_sectors * (sc->alg->stripe_blocks - sc->alg->p_blocks - sc->alg->e_blocks);
-	
-	// Write when stripe ends
-	if ((stripe_sector >= d_sectors) || (prev_stripe != stripe_num))
-	{
-		for (parity_counter = 0; parity_counter < p_blocks; parity_counter++)
-		{
-			device_number = syndromes->device_number[parity_counter];
-			sector_number = syndromes->sector_number[parity_counter];
-			do_bio( sector_number, sc->devs[device_number].dev->bdev, bi_size, bi_vcnt, WRITE );
-		}
-		stripe_sector = stripe_sector % d_sectors;
-	}
+	atomic_sub(insane_bio_info(bio)->bytes, &dev->inflight_bytes);
+	atomic_dec(&dev->inflight);
+	smp_mb__after_atomic_dec();
+	if (waitqueue_active(&sc->throttle_wait))
+		wake_up(&sc->throttle_wait);
 
-	if (prev_stripe != stripe_num) 
+	bio_put(bio);
+	if (io)
+		insane_io_put(io);
+	if (atomic_dec_and_test(&sc->io_pending))
+		wake_up(&sc->io_wait);
+}
+
+// All pages of bio go back to pool at once
+static void insane_bi_end_io( struct bio *bio, int err )
+{
+	struct insane_c *sc = insane_bio_info(bio)->sc;
+	int i;
+
+	for( i = 0; i < bio->bi_vcnt; i++ )
 	{
-		stripe_sector = 0;
+		mempool_free(bio->bi_io_vec[i].bv_page, sc->page_pool);
 	}
-*/
+
+	insane_bio_put(bio);
 }
 
-// Syndrom updating on random write
-static void insane_finish_syndromes (struct bio *bio, struct parity_places *syndromes, struct insane_c *sc)
+// Payload-free bio: pages are shared, nothing to free
+static void insane_sink_end_io( struct bio *bio, int err )
 {
-	sector_t sector;
-	int device_number;
-	struct block_device *bi_bdev;
+	struct insane_io *io = insane_bio_info(bio)->io;
 
-	int p_blocks;
-	int bi_vcnt;
-	int bi_size;
+	// Real parity can't be updated from failed read
+	if (err && io && io->pq)
+		io->error = err;
+	insane_bio_put(bio);
+}
 
-	int parity_counter;
+// Completion of hooked frontend bio: it's finished together with its parity
+static void insane_io_end_io( struct bio *bio, int err )
+{
+	struct insane_io *io = bio->bi_private;
 
-	bi_vcnt = sc->chunk_size_pages;
-	bi_size = sc->chunk_size_bytes;
-	p_blocks = sc->alg->p_blocks;
+	if (err)
+		io->error = err;
+	insane_io_put(io);
+}
 
-	// To update syndrome we need:
-	// 1. New data (already have in bio)
-	// 2. Read old data
-	// 3. Read syndrome
-	// 4. Write syndrome
-	// 5. ??????
-	// 6. PROFIT!
-	//
-	// We are emulating so we don't calculate anything and write garbage.
+// Take over frontend bio completion until parity I/O issued for it is done.
+// Frontend bio holds one reference itself.
+static struct insane_io *insane_io_hook( struct insane_c *sc, struct bio *bio )
+{
+	struct insane_io *io;
+
+	io = mempool_alloc(sc->io_pool, GFP_NOIO);
+	io->sc = sc;
+	io->bio = bio;
+	io->error = 0;
+	io->stage = INSANE_IO_WRITE;
+	io->pq = NULL;
+	io->lock = NULL;
+	atomic_set(&io->pending, 1);
+
+	io->bi_end_io = bio->bi_end_io;
+	io->bi_private = bio->bi_private;
+	bio->bi_end_io = insane_io_end_io;
+	bio->bi_private = io;
+
+	return io;
+}
 
-	// Align sector to chunk size and read old data
-	sector = bio->bi_sector;
-	sector_div(sector, sc->chunk_size);
-	sector = sector << sc->chunk_size_shift;
-	bi_bdev = bio->bi_bdev;
-	do_bio(sector, bi_bdev, bi_size, bi_vcnt, READ);
-	
-	// Read and write each syndrome
-	for (parity_counter = 0; parity_counter < p_blocks; parity_counter++)
-	{
-		sector = syndromes->sector_number[parity_counter];
-		device_number = syndromes->device_number[parity_counter];
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 3, 7, 0 )
+// Emulated write as one logical block repeated by member
+static void insane_write_same( struct insane_c *sc, struct insane_io *io, sector_t sector, struct insane_dev *dev, int bi_size )
+{
+	struct block_device *bdev = dev->dev->bdev;
+	struct bio *bio;
 
-		if (device_number > -1) 
-		{
-			bi_bdev = sc->devs[device_number].dev->bdev;
-			do_bio(sector, bi_bdev, bi_size, bi_vcnt, READ);
-			do_bio(sector, bi_bdev, bi_size, bi_vcnt, WRITE);
-		} 
-		else 
-		{ 
-			break;
-		}
-	}
-}
+	bio = insane_bio_alloc(sc, io, dev, 1, bi_size);
+	bio->bi_bdev = bdev;
+	bio->bi_sector = sector;
+	bio->bi_vcnt = 1;
+	bio->bi_size = bi_size;
+	bio->bi_end_io = insane_sink_end_io;
+	bio->bi_idx = 0;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION( 3, 8, 0 )
-static int insane_map(struct dm_target *ti, struct bio *bio, union map_info *map_context)
-#else
-static int insane_map(struct dm_target *ti, struct bio *bio)
+	bio->bi_io_vec[0].bv_page = ZERO_PAGE(0);
+	bio->bi_io_vec[0].bv_len = bdev_logical_block_size(bdev);
+	bio->bi_io_vec[0].bv_offset = 0;
+
+	submit_bio(WRITE | REQ_WRITE_SAME, bio);
+}
 #endif
+
+// Single bio of bi_size bytes, it must fit in member queue limits
+static void insane_submit_pages( struct insane_c *sc, struct insane_io *io, sector_t sector, struct insane_dev *dev,
+				struct page **pages, int bi_size, int rw )
 {
-	struct insane_c *sc = ti->private;
-	struct parity_places syndromes;
-	int dev_index;
+	struct bio *bio;
+	struct page *parity_page;
+	bool owned;
+
+	int page_counter, bi_vcnt;
+
+	bi_vcnt = DIV_ROUND_UP(bi_size, PAGE_SIZE);
+
+	bio = insane_bio_alloc(sc, io, dev, bi_vcnt, bi_size);
+
+	// Payload pages are taken at once and without waiting, bio goes
+	// payload-free when the pool is short
+	owned = payload && !pages;
+	for (page_counter = 0; owned && page_counter < bi_vcnt; page_counter++)
+	{
+		parity_page = mempool_alloc(sc->page_pool, GFP_NOWAIT | __GFP_NOWARN);
+		if (!parity_page) {
+			while (page_counter--)
+				mempool_free(bio->bi_io_vec[page_counter].bv_page, sc->page_pool);
+			owned = false;
+			break;
+		}
+		bio->bi_io_vec[page_counter].bv_page = parity_page;
+	}
+
+	bio->bi_bdev = dev->dev->bdev;
+	bio->bi_sector = sector;
+	bio->bi_vcnt = bi_vcnt;
+	bio->bi_size = bi_size;
+	bio->bi_end_io = owned ? insane_bi_end_io : insane_sink_end_io;
+	bio->bi_idx = 0;
+
+	for (page_counter = 0; page_counter < bi_vcnt; page_counter++) 
+	{
+		if (pages) // owned by caller
+			parity_page = pages[page_counter];
+		else if (owned)
+			parity_page = bio->bi_io_vec[page_counter].bv_page;
+		else if (rw & WRITE)
+			parity_page = ZERO_PAGE(0);
+		else // shared, preemption may move us to other CPU and it is fine
+			parity_page = per_cpu(insane_sink, raw_smp_processor_id());
+		bio->bi_io_vec[page_counter].bv_len = min_t(int, bi_size, PAGE_SIZE);
+		bio->bi_io_vec[page_counter].bv_page = parity_page;
+		bio->bi_io_vec[page_counter].bv_offset = 0;
+		bi_size -= PAGE_SIZE;
+	}
+
+	submit_bio(rw, bio);
+}
+
+// Parity or rebuild I/O of bi_size bytes on member. It is split into bios
+// as large as member queue accepts (max_sectors, max_segments) and bio
+// can hold. bvecs are single page here, so bio is BIO_MAX_PAGES at most.
+// Data is in pages if they are given, otherwise it is emulated (see payload).
+static void do_bio_pages( struct insane_c *sc, struct insane_io *io, sector_t sector, int device,
+			  struct page **pages, int bi_size, int rw )
+{
+	struct insane_dev *dev = &sc->devs[device];
+	struct block_device *bdev = dev->dev->bdev;
+	struct request_queue *q = bdev_get_queue(bdev);
+	unsigned int max_bytes, size;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 3, 7, 0 )
+	if (!payload && !pages && (rw & WRITE) && bdev_write_same(bdev)) {
+		max_bytes = min_t(unsigned int, bdev_write_same(bdev), UINT_MAX >> SECTOR_SHIFT) << SECTOR_SHIFT;
+		max_bytes = max_t(unsigned int, max_bytes & PAGE_MASK, PAGE_SIZE);
+		while (bi_size > 0) {
+			size = min_t(unsigned int, bi_size, max_bytes);
+			insane_write_same(sc, io, sector, dev, size);
+			sector += size >> SECTOR_SHIFT;
+			bi_size -= size;
+		}
+		return;
+	}
+#endif
+
+	max_bytes = min_t(unsigned int, queue_max_segments(q), BIO_MAX_PAGES) << PAGE_SHIFT;
+	max_bytes = min_t(unsigned int, max_bytes, queue_max_sectors(q) << SECTOR_SHIFT);
+	max_bytes = max_t(unsigned int, max_bytes & PAGE_MASK, PAGE_SIZE);
+
+	while (bi_size > 0) {
+		size = min_t(unsigned int, bi_size, max_bytes);
+		insane_submit_pages(sc, io, sector, dev, pages, size, rw);
+		sector += size >> SECTOR_SHIFT;
+		bi_size -= size;
+		if (pages)
+			pages += size >> PAGE_SHIFT;
+	}
+}
+
+static void do_bio( struct insane_c *sc, struct insane_io *io, sector_t sector, int device, int bi_size, int rw )
+{
+	do_bio_pages(sc, io, sector, device, NULL, bi_size, rw);
+}
+
+// Submit rw of bi_size bytes at offset inside each syndrome chunk.
+// Syndromes are sorted by device and sector, so contiguous extents
+// on the same device go in one bio.
+static void insane_submit_syndromes(struct insane_c *sc, struct insane_io *io, struct parity_places *syndromes,
+				    sector_t offset, int bi_size, int rw)
+{
+	int device_number[MAX_SYNDROMES];
+	sector_t sector_number[MAX_SYNDROMES];
+	int i, j, count, size, device;
+	sector_t sector;
+
+	count = syndromes->count;
+	for (i = 0; i < count; i++) {
+		device = syndromes->device_number[i];
+		sector = syndromes->sector_number[i] + offset;
+
+		for (j = i; j > 0; j--) {
+			if (device_number[j - 1] < device ||
+			    (device_number[j - 1] == device && sector_number[j - 1] < sector))
+				break;
+			device_number[j] = device_number[j - 1];
+			sector_number[j] = sector_number[j - 1];
+		}
+		device_number[j] = device;
+		sector_number[j] = sector;
+	}
+
+	for (i = 0; i < count; i += j) {
+		size = bi_size;
+		for (j = 1; i + j < count; j++) {
+			if (device_number[i + j] != device_number[i] ||
+			    sector_number[i + j] != sector_number[i] + (size >> SECTOR_SHIFT))
+				break;
+			size += bi_size;
+		}
+
+		do_bio(sc, io, sector_number[i], device_number[i], size, rw);
+	}
+}
+
+// Read old data and the same range of each syndrome
+static void insane_rmw_reads(struct insane_c *sc, struct insane_io *io, struct parity_places *syndromes,
+			     int device, sector_t sector, int bi_size)
+{
+	do_bio(sc, io, sector, device, bi_size, READ);
+	insane_submit_syndromes(sc, io, syndromes, sector & (sc->chunk_size - 1), bi_size, READ);
+}
+
+#ifdef INSANE_DEFER_PARITY
+// Queue parity I/O of mapped bio on this CPU instead of submitting it.
+// Waiting write and io_pending are referenced until it's submitted.
+static bool insane_defer(struct insane_c *sc, struct insane_io *io, int kind, struct bio *bio, int device, struct parity_places *syndromes)
+{
+	struct insane_defer *d;
+	struct insane_cpu *cpu;
+	int id;
+
+	if (!defer_parity)
+		return false;
+
+	d = mempool_alloc(sc->defer_pool, GFP_NOIO);
+	d->io = io;
+	d->kind = kind;
+	d->device = device;
+	d->sector = bio->bi_sector;
+	d->size = bio->bi_size;
+	d->syndromes = *syndromes;
+
+	atomic_inc(&sc->io_pending);
+	if (io)
+		atomic_inc(&io->pending);
+
+	// Worker is kicked only when queue was empty, it takes all at once
+	id = get_cpu();
+	cpu = per_cpu_ptr(sc->cpu, id);
+	if (llist_add(&d->node, &cpu->list))
+		queue_work_on(id, sc->wq, &cpu->work);
+	put_cpu();
+
+	return true;
+}
+
+// Submit parity work queued on CPU in queue order under one plug
+static void insane_defer_work(struct work_struct *work)
+{
+	struct insane_cpu *cpu = container_of(work, struct insane_cpu, work);
+	struct insane_c *sc = cpu->sc;
+	struct llist_node *node, *next, *first = NULL;
+	struct insane_defer *d;
+	struct blk_plug plug;
+
+	// llist is LIFO
+	node = llist_del_all(&cpu->list);
+	while (node) {
+		next = node->next;
+		node->next = first;
+		first = node;
+		node = next;
+	}
+
+	blk_start_plug(&plug);
+	for (node = first; node; node = next) {
+		next = node->next;
+		d = llist_entry(node, struct insane_defer, node);
+
+		switch (d->kind) {
+		case INSANE_DEFER_FULL:
+			insane_submit_syndromes(sc, d->io, &d->syndromes, 0, sc->chunk_size_bytes, WRITE);
+			break;
+		case INSANE_DEFER_RMW:
+			insane_rmw_reads(sc, d->io, &d->syndromes, d->device, d->sector, d->size);
+			insane_submit_syndromes(sc, d->io, &d->syndromes, d->sector & (sc->chunk_size - 1), d->size, WRITE);
+			break;
+		case INSANE_DEFER_READ:
+			insane_rmw_reads(sc, d->io, &d->syndromes, d->device, d->sector, d->size);
+			break;
+		}
+
+		if (d->io)
+			insane_io_put(d->io);
+		mempool_free(d, sc->defer_pool);
+		if (atomic_dec_and_test(&sc->io_pending))
+			wake_up(&sc->io_wait);
+	}
+	blk_finish_plug(&plug);
+}
+#else
+static inline bool insane_defer(struct insane_c *sc, struct insane_io *io, int kind, struct bio *bio, int device, struct parity_places *syndromes)
+{
+	return false;
+}
+#endif
+
+// Trace current LBA and submit syndrom update on stripe change.
+// Used on sequential write to prevent performance degrade.
+static void insane_seq_syndromes (struct bio *bio, struct parity_places *syndromes, struct insane_c *sc, int dev_index, struct insane_io *io)
+{
+	struct blk_plug plug;
+	sector_t bi_size;
+	sector_t current_block, next_block;
+
+	current_block = bio->bi_sector >> sc->chunk_size_shift;
+	next_block = (bio->bi_sector + bio->bi_size) >> sc->chunk_size_shift;
+
+	if (current_block != next_block) {
+
+		bi_size = sc->chunk_size_bytes;
+
+		atomic64_inc(&sc->full_writes);
+		if (insane_defer(sc, io, INSANE_DEFER_FULL, bio, dev_index, syndromes))
+			return;
+
+		blk_start_plug(&plug);
+		insane_submit_syndromes(sc, io, syndromes, 0, bi_size, WRITE);
+		blk_finish_plug(&plug);
+	}
+
+/*
+	static sector_t stripe_num = 0;
+	static sector_t stripe_sector = 0;
+	sector_t prev_stripe;
+	sector_t d_sectors, bio_size;
+
+	int p_blocks, bi_size;
+	int device_number;
+	sector_t sector_number;
+	int parity_counter;
+
+	p_blocks = sc->p_blocks;
+	bi_size  = sc->chunk_size_bytes;
+
+	// Calculate stripe number
+	prev_stripe = stripe_num;
+	stripe_num = bio->bi_sector;
+	sector_div(stripe_num, sc->chunk_size);
+	stripe_num = (stripe_num * sc->ndev + dev_index);
+	sector_div(stripe_num, sc->stripe_blocks);
+
+	// Update stripe sector
+	bio_size = bio->bi_size;
+	bio_size >>= SECTOR_SHIFT;
+	stripe_sector = stripe_sector + bio_size;
+
+	d_sectors = sc->chunk_size;
+	d_sectors = d_sectors * (sc->stripe_blocks - sc->p_blocks - sc->e_blocks);
+	
+	// Write when stripe ends
+	if ((stripe_sector >= d_sectors) || (prev_stripe != stripe_num))
+	{
+		for (parity_counter = 0; parity_counter < p_blocks; parity_counter++)
+		{
+			device_number = syndromes->device_number[parity_counter];
+			sector_number = syndromes->sector_number[parity_counter];
+			do_bio( sc, io, sector_number, device_number, bi_size, WRITE );
+		}
+		stripe_sector = stripe_sector % d_sectors;
+	}
+
+	if (prev_stripe != stripe_num) 
+	{
+		stripe_sector = 0;
+	}
+*/
+}
+
+// Syndrom updating on random write
+static void insane_finish_syndromes (struct bio *bio, struct parity_places *syndromes, struct insane_c *sc, int dev_index, struct insane_io *io)
+{
+	struct blk_plug plug;
+	sector_t sector, offset;
+
+	int bi_size;
+
+	// Only the range touched by write is updated, at the same
+	// offset inside each syndrome chunk
+	bi_size = bio->bi_size;
+	offset = bio->bi_sector & (sc->chunk_size - 1);
+
+	// To update syndrome we need:
+	// 1. New data (already have in bio)
+	// 2. Read old data
+	// 3. Read syndrome
+	// 4. Write syndrome
+	// 5. ??????
+	// 6. PROFIT!
+	//
+	// We are emulating so we don't calculate anything and write garbage.
+
+	atomic64_inc(&sc->rmw_writes);
+	if (insane_defer(sc, io, INSANE_DEFER_RMW, bio, dev_index, syndromes))
+		return;
+
+	blk_start_plug(&plug);
+
+	// Read old data
+	sector = bio->bi_sector;
+	insane_rmw_reads(sc, io, syndromes, dev_index, sector, bi_size);
+	
+	// Write each syndrome
+	insane_submit_syndromes(sc, io, syndromes, offset, bi_size, WRITE);
+
+	blk_finish_plug(&plug);
+}
+
+// Second stage of ordered read-modify-write, reads are done.
+// Frontend bio holds one reference, parity writes hold the rest.
+static void insane_rmw_write(struct work_struct *work)
+{
+	struct insane_io *io = container_of(work, struct insane_io, work);
+	struct insane_c *sc = io->sc;
+	struct bio *bio = io->bio;
+	sector_t offset = bio->bi_sector & (sc->chunk_size - 1);
+	struct blk_plug plug;
+
+	atomic_set(&io->pending, 1);
+
+	blk_start_plug(&plug);
+	insane_submit_syndromes(sc, io, &io->syndromes, offset, bio->bi_size, WRITE);
+	generic_make_request(bio);
+	blk_finish_plug(&plug);
+}
+
+// Reads of ordered read-modify-write, stripe lock is held.
+// The last read completion queues insane_rmw_write.
+static void insane_rmw_start(struct insane_io *io)
+{
+	struct insane_c *sc = io->sc;
+	struct bio *bio = io->bio;
+	struct blk_plug plug;
+
+	INIT_WORK(&io->work, insane_rmw_write);
+
+	// Only the range touched by write, see insane_finish_syndromes
+	if (!insane_defer(sc, io, INSANE_DEFER_READ, bio, io->device, &io->syndromes)) {
+		blk_start_plug(&plug);
+		insane_rmw_reads(sc, io, &io->syndromes, io->device, bio->bi_sector, bio->bi_size);
+		blk_finish_plug(&plug);
+	}
+
+	// Drop reference of this stage, reads may be all done already
+	insane_io_put(io);
+}
+
+// Stripe lock is passed to waiting ordered write
+static void insane_rmw_resume(struct work_struct *work)
+{
+	insane_rmw_start(container_of(work, struct insane_io, work));
+}
+
+// First stage of ordered read-modify-write: read old data and syndromes
+// once stripe of frontend sector is locked
+static void insane_rmw_read(struct bio *bio, struct parity_places *syndromes, struct insane_c *sc, int dev_index,
+			    struct insane_io *io, sector_t sector)
+{
+	atomic64_inc(&sc->rmw_writes);
+	io->stage = INSANE_IO_READ;
+	io->syndromes = *syndromes;
+	io->device = dev_index;
+	INIT_WORK(&io->work, insane_rmw_resume);
+
+	if (insane_lock_stripe(sc, io, sector))
+		insane_rmw_start(io);
+}
+
+// Compute mode: real RAID-6 P and Q are updated by read-modify-write.
+// Data delta (old ^ new) is added to P. Its part of Q (g^data_index * delta)
+// is generated by gen_syndrome with zero blocks in other data positions and
+// added to Q. GF(2^8) syndromes get coef * delta by insane_gf_update.
+// Writes of one stripe must not overlap in time.
+// Pages are not taken here, see insane_pq_read. Descriptor comes from
+// pq_pool sized for a chunk, so it doesn't fail.
+static struct insane_pq *insane_pq_alloc( struct insane_c *sc, int bi_size, int nr_syndromes )
+{
+	struct insane_pq *pq;
+	unsigned int nr_pages, count;
+
+	nr_pages = DIV_ROUND_UP(bi_size, PAGE_SIZE);
+	count = insane_pq_count(nr_syndromes, nr_pages);
+
+	pq = mempool_alloc(sc->pq_pool, GFP_NOIO);
+
+	pq->nr_pages = nr_pages;
+	pq->nr_syndromes = nr_syndromes;
+	pq->pages = (struct page **)(pq + 1);
+	pq->ptrs = (void **)(pq->pages + count);
+
+	return pq;
+}
+
+static void insane_pq_compute( struct insane_c *sc, struct insane_io *io )
+{
+	struct insane_pq *pq = io->pq;
+	struct bio *bio = io->bio;
+	struct page **delta = pq->pages;
+	struct page **p = delta + pq->nr_pages;
+	struct page **q = p + pq->nr_pages;
+	struct bio_vec *bvec;
+	unsigned int pos, done, len, i, j, disks;
+	void *src, *data;
+	int seg;
+
+	// Old data becomes delta
+	pos = 0;
+	bio_for_each_segment(bvec, bio, seg) {
+		data = kmap(bvec->bv_page) + bvec->bv_offset;
+		for (done = 0; done < bvec->bv_len; done += len, pos += len) {
+			len = min_t(unsigned int, bvec->bv_len - done, PAGE_SIZE - offset_in_page(pos));
+			src = data + done;
+			xor_blocks(1, len, page_address(delta[pos >> PAGE_SHIFT]) + offset_in_page(pos), &src);
+		}
+		kunmap(bvec->bv_page);
+	}
+
+	if (!sc->alg->pq) {
+		for (i = 0; i < pq->nr_pages; i++) {
+			len = min_t(unsigned int, bio->bi_size - (i << PAGE_SHIFT), PAGE_SIZE);
+			for (j = 0; j < pq->nr_syndromes; j++)
+				pq->ptrs[j] = page_address(p[j * pq->nr_pages + i]);
+			insane_gf_update(pq->nr_syndromes, io->syndromes.coef, len, pq->ptrs,
+					 page_address(delta[i]));
+		}
+		return;
+	}
+
+	disks = io->syndromes.data_count + 2;
+	for (i = 0; i < disks - 2; i++)
+		pq->ptrs[i] = (void *)raid6_empty_zero_page;
+	pq->ptrs[disks - 2] = page_address(pq->pages[3 * pq->nr_pages]);
+	pq->ptrs[disks - 1] = page_address(pq->pages[3 * pq->nr_pages + 1]);
+
+	for (i = 0; i < pq->nr_pages; i++) {
+		len = min_t(unsigned int, bio->bi_size - (i << PAGE_SHIFT), PAGE_SIZE);
+		src = page_address(delta[i]);
+		xor_blocks(1, len, page_address(p[i]), &src);
+
+		pq->ptrs[io->syndromes.data_index] = src;
+		raid6_call.gen_syndrome(disks, len, pq->ptrs);
+		xor_blocks(1, len, page_address(q[i]), &pq->ptrs[disks - 1]);
+	}
+}
+
+// Second stage of compute mode write, old data, P and Q are read
+static void insane_pq_write( struct work_struct *work )
+{
+	struct insane_io *io = container_of(work, struct insane_io, work);
+	struct insane_c *sc = io->sc;
+	struct insane_pq *pq = io->pq;
+	struct bio *bio = io->bio;
+	sector_t offset = bio->bi_sector & (sc->chunk_size - 1);
+	struct blk_plug plug;
+	int i;
+
+	atomic_set(&io->pending, 1);
+
+	// Frontend write fails with read error
+	if (io->error) {
+		insane_io_put(io);
+		return;
+	}
+
+	insane_pq_compute(sc, io);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < pq->nr_syndromes; i++)
+		do_bio_pages(sc, io, io->syndromes.sector_number[i] + offset, io->syndromes.device_number[i],
+			     pq->pages + (i + 1) * pq->nr_pages, bio->bi_size, WRITE);
+	generic_make_request(bio);
+	blk_finish_plug(&plug);
+}
+
+// Keep only syndromes covering the block, sequential mode maps all of them
+static void insane_gf_syndromes(struct parity_places *syndromes)
+{
+	int i, count;
+
+	for (i = 0, count = 0; i < syndromes->count; i++) {
+		if (!syndromes->coef[i])
+			continue;
+		syndromes->device_number[count] = syndromes->device_number[i];
+		syndromes->sector_number[count] = syndromes->sector_number[i];
+		syndromes->coef[count] = syndromes->coef[i];
+		count++;
+	}
+	syndromes->count = count;
+}
+
+// Reads of compute mode write, stripe lock is held
+static void insane_pq_start( struct insane_io *io )
+{
+	struct insane_c *sc = io->sc;
+	struct insane_pq *pq = io->pq;
+	struct bio *bio = io->bio;
+	sector_t offset = bio->bi_sector & (sc->chunk_size - 1);
+	struct blk_plug plug;
+	int i;
+
+	INIT_WORK(&io->work, insane_pq_write);
+
+	blk_start_plug(&plug);
+	do_bio_pages(sc, io, bio->bi_sector, io->device, pq->pages, bio->bi_size, READ);
+	for (i = 0; i < pq->nr_syndromes; i++)
+		do_bio_pages(sc, io, io->syndromes.sector_number[i] + offset, io->syndromes.device_number[i],
+			     pq->pages + (i + 1) * pq->nr_pages, bio->bi_size, READ);
+	blk_finish_plug(&plug);
+
+	insane_io_put(io);
+}
+
+// Stripe lock is passed to waiting compute mode write
+static void insane_pq_resume( struct work_struct *work )
+{
+	insane_pq_start(container_of(work, struct insane_io, work));
+}
+
+// Page pool was short in map: wait for all pages of compute mode write
+// here, then take stripe lock. Lock is never held while waiting, so
+// writes holding pages always complete and refill the pool.
+static void insane_pq_wait_pages( struct work_struct *work )
+{
+	struct insane_io *io = container_of(work, struct insane_io, work);
+	struct insane_c *sc = io->sc;
+	struct insane_pq *pq = io->pq;
+
+	mutex_lock(&sc->page_lock);
+	insane_alloc_pages(sc, pq->pages, insane_pq_count(pq->nr_syndromes, pq->nr_pages), GFP_NOIO);
+	mutex_unlock(&sc->page_lock);
+
+	INIT_WORK(&io->work, insane_pq_resume);
+	if (insane_lock_stripe(sc, io, io->sector))
+		insane_pq_start(io);
+}
+
+// First stage of compute mode write: read old data and syndromes of the
+// range once stripe of frontend sector is locked
+static int insane_pq_read( struct bio *bio, struct parity_places *syndromes, struct insane_c *sc, int dev_index,
+			   sector_t sector )
+{
+	struct insane_io *io;
+	struct insane_pq *pq;
+
+	if (sc->alg->pq)
+		pq = insane_pq_alloc(sc, bio->bi_size, 2);
+	else {
+		insane_gf_syndromes(syndromes);
+		pq = insane_pq_alloc(sc, bio->bi_size, syndromes->count);
+	}
+
+	atomic64_inc(&sc->rmw_writes);
+	io = insane_io_hook(sc, bio);
+	io->pq = pq;
+	io->stage = INSANE_IO_READ;
+	io->syndromes = *syndromes;
+	io->device = dev_index;
+	io->sector = sector;
+
+	if (!insane_alloc_pages(sc, pq->pages, insane_pq_count(pq->nr_syndromes, pq->nr_pages),
+				GFP_NOWAIT | __GFP_NOWARN)) {
+		INIT_WORK(&io->work, insane_pq_wait_pages);
+		queue_work(sc->wq, &io->work);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	INIT_WORK(&io->work, insane_pq_resume);
+	if (insane_lock_stripe(sc, io, sector))
+		insane_pq_start(io);
+	return DM_MAPIO_SUBMITTED;
+}
+
+// Add syndromes not yet in union
+static void insane_syndromes_union(struct parity_places *to, struct parity_places *from)
+{
+	int i, j;
+
+	for (i = 0; i < from->count; i++) {
+		for (j = 0; j < to->count; j++) {
+			if (to->device_number[j] == from->device_number[i] &&
+			    to->sector_number[j] == from->sector_number[i])
+				break;
+		}
+		if (j == to->count && to->count < MAX_SYNDROMES) {
+			to->device_number[to->count] = from->device_number[i];
+			to->sector_number[to->count] = from->sector_number[i];
+			to->count++;
+		}
+	}
+}
+
+// Data chunks of virtual stripe mapped per map_range call
+#define INSANE_MAP_BATCH 16
+
+// Member start sectors of data chunks [first, first + count) of virtual
+// stripe, in one map_range call when algorithm has it
+static void insane_map_chunks(struct insane_c *sc, u64 number, unsigned int first, unsigned int count,
+			      sector_t *sector, int *dev)
+{
+	unsigned int i;
+	uint32_t lane;
+	u64 chunk, block;
+
+	chunk = number * sc->group_blocks + first;
+	if (sc->alg->map_range) {
+		sc->alg->map_range(sc, chunk, count, sector, dev);
+		return;
+	}
+
+	for (i = 0; i < count; i++, chunk++) {
+		insane_map_sector(sc, chunk << sc->chunk_size_shift, &block, &lane, &sector[i]);
+		dev[i] = lane;
+		sc->alg->map(sc, block, &sector[i], &dev[i], NULL);
+	}
+}
+
+// Coverage of syndromes of each data block of parity group, built once
+// on device creation: block q is covered by p when a syndrome written for
+// p has q in it, local syndrome covers only its group, zero GF(2^8)
+// coefficient covers nothing. Syndromes are laid out alike in all groups,
+// so the first group is mapped.
+static int insane_create_cover(struct insane_c *sc)
+{
+	unsigned int words = BITS_TO_LONGS(sc->group_blocks);
+	struct parity_places *own;
+	unsigned int p, q;
+	uint32_t lane;
+	sector_t sector;
+	int dev, i, j;
+	u64 block;
+
+	own = vmalloc(sizeof(*own) * sc->group_blocks);
+	if (!own)
+		return -ENOMEM;
+
+	sc->group_cover = vmalloc(sizeof(unsigned long) * words * sc->group_blocks);
+	if (!sc->group_cover) {
+		vfree(own);
+		return -ENOMEM;
+	}
+	memset(sc->group_cover, 0, sizeof(unsigned long) * words * sc->group_blocks);
+
+	for (p = 0; p < sc->group_blocks; p++) {
+		insane_map_sector(sc, (sector_t)p << sc->chunk_size_shift, &block, &lane, &sector);
+		dev = lane;
+		sc->alg->map(sc, block, &sector, &dev, &own[p]);
+	}
+
+	for (p = 0; p < sc->group_blocks; p++) {
+		for (q = 0; q < sc->group_blocks; q++) {
+			for (i = 0; i < own[q].count; i++) {
+				if (sc->alg->gf && !own[q].coef[i])
+					continue;
+				for (j = 0; j < own[p].count; j++) {
+					if (own[q].device_number[i] == own[p].device_number[j] &&
+					    own[q].sector_number[i] == own[p].sector_number[j])
+						break;
+				}
+				if (j < own[p].count) {
+					__set_bit(q, sc->group_cover + p * words);
+					break;
+				}
+			}
+		}
+	}
+
+	vfree(own);
+	return 0;
+}
+
+// Data chunks of virtual stripe covered by syndromes of its dirty chunks,
+// only their clean units are read by reconstruct-write. P and Q cover all
+// data of stripe, others are looked up in group_cover.
+static void insane_stripe_covered(struct insane_c *sc, const unsigned long *dirty, unsigned long *covered)
+{
+	unsigned int chunk_units = 1 << (sc->chunk_size_shift - sc->stripe_unit_shift);
+	unsigned int words = BITS_TO_LONGS(sc->group_blocks);
+	unsigned int chunk, base;
+
+	bitmap_zero(covered, INSANE_STRIPE_UNITS);
+	if (sc->alg->pq) {
+		bitmap_fill(covered, sc->group_blocks);
+		return;
+	}
+
+	for (chunk = 0, base = 0; chunk < sc->group_blocks; chunk++, base += chunk_units) {
+		if (find_next_bit(dirty, base + chunk_units, base) < base + chunk_units)
+			bitmap_or(covered, covered, sc->group_cover + chunk * words, sc->group_blocks);
+	}
+}
+
+// Runs of dirty (or clean) units inside window [from, to) of each data
+// chunk of stripe (of covered chunks if covered is given), they are read
+// if read is set. Returns number of runs.
+static unsigned int insane_stripe_runs(struct insane_c *sc, u64 number, const unsigned long *dirty,
+				       const unsigned long *covered, bool set, unsigned int from,
+				       unsigned int to, bool read)
+{
+	unsigned int chunk_units = 1 << (sc->chunk_size_shift - sc->stripe_unit_shift);
+	unsigned int data_blocks = sc->stripe_units / chunk_units;
+	unsigned int base, unit, end, chunk, first = 0, mapped = 0, count = 0;
+	sector_t sector[INSANE_MAP_BATCH];
+	int dev[INSANE_MAP_BATCH];
+
+	for (base = 0, chunk = 0; base < sc->stripe_units; base += chunk_units, chunk++) {
+		if (covered && !test_bit(chunk, covered))
+			continue;
+		for (unit = base + from; unit < base + to; unit = end) {
+			if (set) {
+				unit = find_next_bit(dirty, base + to, unit);
+				end = find_next_zero_bit(dirty, base + to, unit);
+			} else {
+				unit = find_next_zero_bit(dirty, base + to, unit);
+				end = find_next_bit(dirty, base + to, unit);
+			}
+			if (unit >= base + to)
+				break;
+
+			count++;
+			if (!read)
+				continue;
+
+			// Read units [unit, end), they are inside the chunk
+			if (chunk >= first + mapped) {
+				first = chunk;
+				mapped = min_t(unsigned int, data_blocks - chunk, INSANE_MAP_BATCH);
+				insane_map_chunks(sc, number, first, mapped, sector, dev);
+			}
+			do_bio(sc, NULL, sector[chunk - first] + ((unit - base) << sc->stripe_unit_shift),
+			       dev[chunk - first], (end - unit) << (sc->stripe_unit_shift + SECTOR_SHIFT), READ);
+		}
+	}
+
+	return count;
+}
+
+// Parity of partially written virtual stripe, dirty units of its data are
+// given by bitmap. Syndromes are updated once over the union of dirty
+// ranges inside chunks, either by read-modify-write (old dirty data and
+// syndromes are read) or by reconstruct-write (clean data is read), the
+// one with fewer member I/Os wins (read-modify-write on tie, it reads
+// less). Without clean data it is full stripe write.
+static void insane_stripe_parity(struct insane_c *sc, u64 number, const unsigned long *dirty,
+				 struct parity_places *syndromes)
+{
+	unsigned int chunk_units = 1 << (sc->chunk_size_shift - sc->stripe_unit_shift);
+	unsigned int unit, from, to, rmw, rcw, offset;
+	DECLARE_BITMAP(covered, INSANE_STRIPE_UNITS);
+	const unsigned long *cover = NULL;
+	struct blk_plug plug;
+	sector_t sector;
+	int bi_size;
+
+	from = chunk_units;
+	to = 0;
+	for (unit = find_first_bit(dirty, sc->stripe_units); unit < sc->stripe_units;
+	     unit = find_next_bit(dirty, sc->stripe_units, unit + 1)) {
+		offset = unit & (chunk_units - 1);
+		from = min(from, offset);
+		to = max(to, offset + 1);
+	}
+	if (from >= to)
+		return;
+
+	rmw = insane_stripe_runs(sc, number, dirty, NULL, true, from, to, false) + 2 * syndromes->count;
+	rcw = insane_stripe_runs(sc, number, dirty, NULL, false, from, to, false);
+	if (rcw) {
+		insane_stripe_covered(sc, dirty, covered);
+		cover = covered;
+		rcw = insane_stripe_runs(sc, number, dirty, cover, false, from, to, false);
+	}
+	rcw += syndromes->count;
+
+	sector = (sector_t)from << sc->stripe_unit_shift;
+	bi_size = (to - from) << (sc->stripe_unit_shift + SECTOR_SHIFT);
+
+	blk_start_plug(&plug);
+	if (rmw <= rcw || (!reconstruct_write && rcw != syndromes->count)) {
+		atomic64_inc(&sc->rmw_writes);
+		insane_stripe_runs(sc, number, dirty, NULL, true, from, to, true);
+		insane_submit_syndromes(sc, NULL, syndromes, sector, bi_size, READ);
+	} else {
+		atomic64_inc(rcw == syndromes->count ? &sc->full_writes : &sc->rcw_writes);
+		insane_stripe_runs(sc, number, dirty, cover, false, from, to, true);
+	}
+	insane_submit_syndromes(sc, NULL, syndromes, sector, bi_size, WRITE);
+	blk_finish_plug(&plug);
+}
+
+// Mark units of frontend range [start, end) inside one virtual stripe,
+// returns the stripe
+static u64 insane_stripe_mark(struct insane_c *sc, sector_t start, sector_t end, unsigned long *dirty)
+{
+	sector_t stripe_start;
+	unsigned int unit, last;
+	u64 number;
+
+	number = start >> sc->chunk_size_shift;
+	insane_div(number, &sc->group_div);
+	stripe_start = number * ((sector_t)sc->stripe_units << sc->stripe_unit_shift);
+
+	bitmap_zero(dirty, INSANE_STRIPE_UNITS);
+	last = DIV_ROUND_UP(end - stripe_start, 1 << sc->stripe_unit_shift);
+	for (unit = (start - stripe_start) >> sc->stripe_unit_shift; unit < last; unit++)
+		__set_bit(unit, dirty);
+
+	return number;
+}
+
+// Parity of partially written stripe accumulated by stream, called with
+// stream_lock held. Stream is flushed in place with the lock dropped,
+// writers skip it meanwhile. Stream range starts at next afterwards.
+static void insane_stream_flush(struct insane_c *sc, struct insane_stream *stream)
+{
+	DECLARE_BITMAP(dirty, INSANE_STRIPE_UNITS);
+	u64 number;
+
+	stream->flushing = true;
+	spin_unlock(&sc->stream_lock);
+
+	number = insane_stripe_mark(sc, stream->start, stream->next, dirty);
+	insane_stripe_parity(sc, number, dirty, &stream->syndromes);
+
+	spin_lock(&sc->stream_lock);
+	stream->start = stream->next;
+	stream->syndromes.count = 0;
+	stream->flushing = false;
+}
+
+// Parity of single random write, narrow stripes are cheaper
+// by reconstruct-write
+static void insane_write_parity(struct insane_c *sc, sector_t sector, unsigned int sectors, struct parity_places *syndromes)
+{
+	DECLARE_BITMAP(dirty, INSANE_STRIPE_UNITS);
+	u64 number;
+
+	number = insane_stripe_mark(sc, sector, sector + sectors, dirty);
+	insane_stripe_parity(sc, number, dirty, syndromes);
+}
+
+// Flush partial stripes of streams idle for stream_timeout
+static void insane_stream_timeout(struct work_struct *work)
+{
+	struct insane_c *sc = container_of(work, struct insane_c, stream_work.work);
+	unsigned long timeout = msecs_to_jiffies(stream_timeout);
+	struct insane_stream *stream;
+	bool pending = false;
+	int i;
+
+	spin_lock(&sc->stream_lock);
+	for (i = 0; i < INSANE_STREAMS; i++) {
+		stream = &sc->streams[i];
+		if (!stream->active || stream->flushing || stream->start == stream->next)
+			continue;
+
+		if (time_after_eq(jiffies, stream->last + timeout))
+			insane_stream_flush(sc, stream);
+		else
+			pending = true;
+	}
+	if (pending)
+		queue_delayed_work(sc->wq, &sc->stream_work, timeout);
+	spin_unlock(&sc->stream_lock);
+}
+
+// Adaptive io_pattern: find stream continued by write of frontend range.
+// Returns SEQUENTIAL if stream takes the write, syndromes then have all
+// syndromes of stripe and last_block set when stripe is complete.
+// Write starting new stream inside stripe is RANDOM, so is write finding
+// all streams flushed.
+static int insane_stream_write(struct insane_c *sc, sector_t sector, unsigned int sectors, struct parity_places *syndromes)
+{
+	struct insane_stream *stream, *victim;
+	sector_t stripe_len, stripe_start;
+	int i, pattern = SEQUENTIAL;
+	u64 stripe;
+
+	stripe_len = (sector_t)sc->group_blocks << sc->chunk_size_shift;
+	stripe = sector >> sc->chunk_size_shift;
+	insane_div(stripe, &sc->group_div);
+	stripe_start = stripe * stripe_len;
+
+	syndromes->last_block = false;
+
+	spin_lock(&sc->stream_lock);
+	for (;;) {
+		victim = NULL;
+		for (i = 0; i < INSANE_STREAMS; i++) {
+			stream = &sc->streams[i];
+			if (stream->flushing)
+				continue;
+			if (stream->active && stream->next == sector)
+				break;
+			if (!victim || (victim->active && (!stream->active || time_before(stream->last, victim->last))))
+				victim = stream;
+		}
+		if (i < INSANE_STREAMS || !victim || !victim->active || victim->start == victim->next)
+			break;
+
+		// Least recently used stream is replaced, its stripe is
+		// flushed first and streams are searched again
+		insane_stream_flush(sc, victim);
+	}
+
+	if (i == INSANE_STREAMS && !victim) {
+		spin_unlock(&sc->stream_lock);
+		return RANDOM;
+	}
+
+	if (i == INSANE_STREAMS) {
+		stream = victim;
+		stream->active = true;
+		stream->end = stripe_start + stripe_len;
+		stream->syndromes.count = 0;
+		if (sector == stripe_start) {
+			stream->start = sector;
+		} else {
+			stream->start = sector + sectors;
+			pattern = RANDOM;
+		}
+	}
+
+	stream->next = sector + sectors;
+	stream->last = jiffies;
+	if (pattern == SEQUENTIAL)
+		insane_syndromes_union(&stream->syndromes, syndromes);
+
+	if (stream->next == stream->end) {
+		if (stream->start == stream->end - stripe_len) {
+			*syndromes = stream->syndromes;
+			syndromes->last_block = true;
+		} else if (stream->start != stream->next) {
+			insane_stream_flush(sc, stream);
+		}
+
+		stream->start = stream->end;
+		stream->end += stripe_len;
+		stream->syndromes.count = 0;
+	} else if (stream->start != stream->next) {
+		queue_delayed_work(sc->wq, &sc->stream_work, msecs_to_jiffies(stream_timeout));
+	}
+	spin_unlock(&sc->stream_lock);
+
+	return pattern;
+}
+
+// Take dirty entry out of cache and LRU, nobody else sees it until
+// insane_stripe_free. Called with stripe_lock held.
+static void insane_stripe_evict(struct insane_c *sc, struct insane_stripe *stripe)
+{
+	hlist_del_init(&stripe->hash);
+	list_del_init(&stripe->lru);
+}
+
+// Evicted entry becomes the first free one
+static void insane_stripe_free(struct insane_c *sc, struct insane_stripe *stripe)
+{
+	list_add(&stripe->lru, &sc->stripe_lru);
+}
+
+// Parity of dirty entry, it is evicted and flushed in place with
+// stripe_lock dropped, then freed. Called with stripe_lock held.
+static void insane_stripe_flush(struct insane_c *sc, struct insane_stripe *stripe)
+{
+	insane_stripe_evict(sc, stripe);
+	spin_unlock(&sc->stripe_lock);
+
+	insane_stripe_parity(sc, stripe->number, stripe->dirty, &stripe->syndromes);
+
+	spin_lock(&sc->stripe_lock);
+	insane_stripe_free(sc, stripe);
+}
+
+// Flush stripes idle for cache_timeout, oldest are first in LRU
+static void insane_stripe_timeout(struct work_struct *work)
+{
+	struct insane_c *sc = container_of(work, struct insane_c, stripe_work.work);
+	unsigned long timeout = msecs_to_jiffies(cache_timeout);
+	struct insane_stripe *stripe;
+	bool found;
+
+	spin_lock(&sc->stripe_lock);
+	do {
+		found = false;
+		list_for_each_entry(stripe, &sc->stripe_lru, lru) {
+			if (hlist_unhashed(&stripe->hash))
+				continue;
+
+			if (time_after_eq(jiffies, stripe->last + timeout))
+				found = true;
+			else
+				queue_delayed_work(sc->wq, &sc->stripe_work, timeout);
+			break;
+		}
+
+		// LRU changes while lock is dropped, it is walked again
+		if (found)
+			insane_stripe_flush(sc, stripe);
+	} while (found);
+	spin_unlock(&sc->stripe_lock);
+}
+
+// Random write of frontend range (inside one chunk) marks its units dirty
+// in cached stripe. Complete stripe gets its syndromes written at once,
+// least recently used stripe is flushed to make room for a new one. If
+// all entries are being flushed, parity of the write is updated at once.
+static void insane_stripe_write(struct insane_c *sc, sector_t sector, unsigned int sectors, struct parity_places *syndromes)
+{
+	struct insane_stripe *stripe;
+	struct hlist_head *head;
+	struct hlist_node *node;
+	struct blk_plug plug;
+	sector_t stripe_sectors, offset;
+	unsigned int unit, last;
+	bool complete = false;
+	u64 number;
+
+	stripe_sectors = (sector_t)sc->stripe_units << sc->stripe_unit_shift;
+	number = sector >> sc->chunk_size_shift;
+	insane_div(number, &sc->group_div);
+	offset = sector - number * stripe_sectors;
+
+	head = &sc->stripe_hash[hash_64(number, sc->stripe_hash_bits)];
+
+	spin_lock(&sc->stripe_lock);
+	for (;;) {
+		stripe = NULL;
+		for (node = head->first; node; node = node->next) {
+			if (hlist_entry(node, struct insane_stripe, hash)->number == number) {
+				stripe = hlist_entry(node, struct insane_stripe, hash);
+				break;
+			}
+		}
+		if (stripe || list_empty(&sc->stripe_lru))
+			break;
+
+		stripe = list_first_entry(&sc->stripe_lru, struct insane_stripe, lru);
+		if (hlist_unhashed(&stripe->hash))
+			break;
+
+		// Least recently used stripe is flushed, then cache is
+		// searched again as it changes while lock is dropped
+		insane_stripe_flush(sc, stripe);
+	}
+
+	if (!stripe) {
+		spin_unlock(&sc->stripe_lock);
+		insane_write_parity(sc, sector, sectors, syndromes);
+		return;
+	}
+
+	if (hlist_unhashed(&stripe->hash)) {
+		stripe->number = number;
+		stripe->dirty_count = 0;
+		stripe->syndromes.count = 0;
+		bitmap_zero(stripe->dirty, INSANE_STRIPE_UNITS);
+		hlist_add_head(&stripe->hash, head);
+	}
+
+	last = (offset + sectors - 1) >> sc->stripe_unit_shift;
+	for (unit = offset >> sc->stripe_unit_shift; unit <= last; unit++) {
+		if (!__test_and_set_bit(unit, stripe->dirty))
+			stripe->dirty_count++;
+	}
+	insane_syndromes_union(&stripe->syndromes, syndromes);
+	stripe->last = jiffies;
+	list_move_tail(&stripe->lru, &sc->stripe_lru);
+
+	if (stripe->dirty_count == sc->stripe_units) {
+		*syndromes = stripe->syndromes;
+		complete = true;
+		insane_stripe_evict(sc, stripe);
+		insane_stripe_free(sc, stripe);
+	} else {
+		queue_delayed_work(sc->wq, &sc->stripe_work, msecs_to_jiffies(cache_timeout));
+	}
+	spin_unlock(&sc->stripe_lock);
+
+	// Whole stripe is new, nothing to read
+	if (complete) {
+		atomic64_inc(&sc->full_writes);
+		blk_start_plug(&plug);
+		insane_submit_syndromes(sc, NULL, syndromes, 0, sc->chunk_size_bytes, WRITE);
+		blk_finish_plug(&plug);
+	}
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION( 3, 8, 0 )
+static int insane_map(struct dm_target *ti, struct bio *bio, union map_info *map_context)
+#else
+static int insane_map(struct dm_target *ti, struct bio *bio)
+#endif
+{
+	struct insane_c *sc = ti->private;
+	struct parity_places syndromes;
+	struct insane_io *io = NULL;
+	sector_t sector = dm_target_offset(ti, bio->bi_sector);
+	int dev_index, pattern;
 	u64 block;
 
 	if (   unlikely(bio->bi_rw & REQ_FLUSH) 
@@ -675,25 +2271,62 @@ static int insane_map(struct dm_target *ti, struct bio *bio)
 	}
 
 	// First, map sector to specific disk and calculate block and lane offset.
-	insane_map_sector(sc, bio->bi_sector, &block, &dev_index, &bio->bi_sector);
+	insane_map_sector(sc, sector, &block, &dev_index, &bio->bi_sector);
 
 	// Second, remap sector again according to algorithm data placement scheme.
-	syndromes = sc->alg->map(sc, block, &bio->bi_sector, &dev_index);
+	// Syndromes are needed only on write.
+	if( !(bio->bi_rw & WRITE) )
+	{
+		sc->alg->map(sc, block, &bio->bi_sector, &dev_index, NULL);
+		bio->bi_bdev = sc->devs[dev_index].dev->bdev;
+		dm_debug("bi_sector: %lld\n", (u64)bio->bi_sector);
+		return DM_MAPIO_REMAPPED;
+	}
+
+	sc->alg->map(sc, block, &bio->bi_sector, &dev_index, &syndromes);
 
 	// Don't forget to change device.
 	bio->bi_bdev = sc->devs[dev_index].dev->bdev;
+
+	// Real parity, data is written by second stage
+	if (compute && (sc->alg->pq || sc->alg->gf))
+		return insane_pq_read(bio, &syndromes, sc, dev_index, sector);
+
+	pattern = sc->io_pattern;
+	if (pattern == ADAPTIVE)
+		pattern = insane_stream_write(sc, sector, bio->bi_size >> SECTOR_SHIFT, &syndromes);
+
+	// Parity of random write is postponed by stripe cache. Modes tying
+	// parity to frontend bio bypass it.
+	if (pattern != SEQUENTIAL && sc->stripes && !wait_parity && !ordered_rmw) {
+		insane_stripe_write(sc, sector, bio->bi_size >> SECTOR_SHIFT, &syndromes);
+		return DM_MAPIO_REMAPPED;
+	}
+
+	if (wait_parity || (ordered_rmw && pattern != SEQUENTIAL))
+		io = insane_io_hook(sc, bio);
         
-	if( bio->bi_rw & WRITE )
-	{
-		if( sc->io_pattern == SEQUENTIAL ) {
+	if( pattern == SEQUENTIAL ) {
 		if (syndromes.last_block == true)
-				insane_seq_syndromes(bio, &syndromes, sc, dev_index);
+			insane_seq_syndromes(bio, &syndromes, sc, dev_index, io);
 	}
-		else
-			insane_finish_syndromes(bio, &syndromes, sc);
+	else if (ordered_rmw) {
+		// Data is written by second stage
+		insane_rmw_read(bio, &syndromes, sc, dev_index, io, sector);
+		return DM_MAPIO_SUBMITTED;
 	}
+	else if (reconstruct_write && !io && !defer_parity)
+		insane_write_parity(sc, sector, bio->bi_size >> SECTOR_SHIFT, &syndromes);
+	else
+		insane_finish_syndromes(bio, &syndromes, sc, dev_index, io);
         
 	dm_debug("bi_sector: %lld\n", (u64)bio->bi_sector);
+
+	// Hooked bio is submitted here, its parity is already in flight
+	if (io) {
+		generic_make_request(bio);
+		return DM_MAPIO_SUBMITTED;
+	}
 	return DM_MAPIO_REMAPPED;
 }
 
@@ -703,6 +2336,7 @@ static int insane_map(struct dm_target *ti, struct bio *bio)
  * INFO
  * #devices [device_name <device_name>] [group word count]
  * [error count 'A|D' <error count 'A|D'>]
+ * [full stripe writes] [reconstruct-writes] [read-modify-writes]
  *
  * TABLE
  * #devices [device chunk size]
@@ -734,6 +2368,8 @@ static int insane_status(struct dm_target *ti, status_type_t type, unsigned stat
 		}
 		buffer[i] = '\0';
 		DMEMIT("1 %s", buffer);
+		DMEMIT(" %llu %llu %llu", (u64)atomic64_read(&sc->full_writes),
+		       (u64)atomic64_read(&sc->rcw_writes), (u64)atomic64_read(&sc->rmw_writes));
 		break;
 
 	case STATUSTYPE_TABLE:
@@ -847,7 +2483,7 @@ static void insane_io_hints(struct dm_target *ti, struct queue_limits *limits)
 static int insane_merge(struct dm_target *ti, struct bvec_merge_data *bvm, struct bio_vec *biovec, int max_size)
 {
 	struct insane_c *sc = ti->private;
-	sector_t bvm_sector = bvm->bi_sector;
+	sector_t bvm_sector = dm_target_offset(ti, bvm->bi_sector);
 	uint32_t dev_index;
 	struct request_queue *q;
 	u64 block;
@@ -878,6 +2514,40 @@ static struct target_type insane_target = {
 	.merge	= insane_merge,
 };
 
+// Compute reciprocal of divisor for insane_div().
+//
+// For divisor d that is not a power of 2, with l = ceil(log2(d)):
+//   magic = floor(2^64 * (2^l - d) / d) + 1
+//   q     = (mulhi(n, magic) + ((n - mulhi(n, magic)) >> 1)) >> (l - 1)
+// which is exact for every 64-bit n. Called on construction only.
+void insane_div_init(struct insane_divisor *div, u32 divisor)
+{
+	u64 rem, hi, lo;
+	int l;
+
+	BUG_ON(!divisor);
+
+	l = fls(divisor - 1); // ceil(log2(divisor)), 0 for 1
+	div->divisor = divisor;
+	div->magic = 0;
+	div->shift = l;
+
+	if (!(divisor & (divisor - 1)))
+		return;
+
+	// 2^64 * (2^l - d) / d in two 32-bit long division steps,
+	// (2^l - d) < d so every partial quotient fits in 32 bits.
+	rem = (1ULL << l) - divisor;
+	hi = rem << 32;
+	rem = do_div(hi, divisor);
+	lo = rem << 32;
+	do_div(lo, divisor);
+
+	div->magic = ((hi << 32) | lo) + 1;
+	div->shift = l - 1;
+}
+EXPORT_SYMBOL(insane_div_init);
+
 int insane_register(struct insane_algorithm *alg)
 {
 	struct insane_algorithm *cur;
@@ -887,6 +2557,12 @@ int insane_register(struct insane_algorithm *alg)
 		return -EINVAL;
 	}
 
+	if (alg->p_blocks > MAX_SYNDROMES) {
+		dm_log("Algorithm %s has too many syndromes (%u > %d)\n",
+			alg->name, alg->p_blocks, MAX_SYNDROMES);
+		return -EINVAL;
+	}
+
 	spin_lock( &alg_list_lock );
 	list_for_each_entry(cur, &alg_list, list)
 	{
@@ -947,13 +2623,34 @@ int insane_unregister(struct insane_algorithm *alg)
 }
 EXPORT_SYMBOL(insane_unregister);
 
+static void insane_free_sink(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (per_cpu(insane_sink, cpu))
+			__free_page(per_cpu(insane_sink, cpu));
+		per_cpu(insane_sink, cpu) = NULL;
+	}
+}
+
 int __init insane_init(void)
 {
 	int r;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		per_cpu(insane_sink, cpu) = alloc_page(GFP_KERNEL);
+		if (!per_cpu(insane_sink, cpu)) {
+			insane_free_sink();
+			return -ENOMEM;
+		}
+	}
 
 	r = dm_register_target( &insane_target );
 	if (r < 0) {
 		dm_log("target registration failed");
+		insane_free_sink();
 		return r;
 	}
 
@@ -965,12 +2662,25 @@ void insane_exit(void)
 {
 	dm_log("Exiting insane striping\n");
 	dm_unregister_target(&insane_target);
+	insane_free_sink();
 }
 
 module_init(insane_init);
 module_exit(insane_exit);
 
 module_param( debug, int, S_IRUGO | S_IWUSR );
+module_param( payload, int, S_IRUGO | S_IWUSR );
+module_param( wait_parity, int, S_IRUGO | S_IWUSR );
+module_param( ordered_rmw, int, S_IRUGO | S_IWUSR );
+module_param( defer_parity, int, S_IRUGO | S_IWUSR );
+module_param( max_inflight, int, S_IRUGO | S_IWUSR );
+module_param( max_inflight_kb, int, S_IRUGO | S_IWUSR );
+module_param( parity_ioprio, int, S_IRUGO | S_IWUSR );
+module_param( stream_timeout, int, S_IRUGO | S_IWUSR );
+module_param( compute, int, S_IRUGO | S_IWUSR );
+module_param( stripe_cache, int, S_IRUGO | S_IWUSR );
+module_param( cache_timeout, int, S_IRUGO | S_IWUSR );
+module_param( reconstruct_write, int, S_IRUGO | S_IWUSR );
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Evgeniy Anastasiev");
@@ -0,0 +1,379 @@
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/device.h>
+#include <linux/firmware.h>
+#include <asm/unaligned.h>
+#include "insane.h"
+
+/*
+ * Table driven algorithm.
+ *
+ * Placement map is loaded with request_firmware, so layouts made offline
+ * (block designs, declustering, tuned LRC) don't need own kernel module.
+ * Map file name is given in table as "table:<file>", default is
+ * TABLE_DEFAULT_FILE. File describes one layout period (virtual stripe) of
+ * stripe_blocks slots, laid out on lanes the same way as LRC does.
+ *
+ * File format, little endian:
+ *
+ *   header: le32 magic (TABLE_MAGIC), le16 version (TABLE_VERSION),
+ *           le16 slots (stripe_blocks)
+ *   slots records:
+ *           u8   role          TABLE_DATA, TABLE_PARITY or TABLE_EMPTY
+ *           u8   parity_count  syndromes updated on random write of data slot
+ *           u8   read_count    recovery set size
+ *           u8   reserved
+ *           le16 write_slot    rebuild target, TABLE_NONE if not rebuilt
+ *           le16 parity[parity_count]
+ *           le16 read[read_count]
+ *
+ * Data blocks are placed in data slots in slot order.
+ */
+
+#define TABLE_MAGIC        0x42545349 // "ISTB"
+#define TABLE_VERSION      1
+#define TABLE_DEFAULT_FILE "insane_table.bin"
+#define TABLE_MAX_SLOTS    256
+#define TABLE_NONE         0xffff
+
+enum table_role {
+	TABLE_DATA,
+	TABLE_PARITY,
+	TABLE_EMPTY,
+};
+
+static void algorithm_table( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity );
+static int table_configure( struct insane_c *ctx );
+static void table_destroy( struct insane_c *ctx );
+static struct recover_stripe recover_table(struct insane_c *ctx, u64 block, int device_number);
+static void algorithm_table_range( struct insane_c *ctx, u64 chunk, unsigned int count, sector_t *sector, int *device_number );
+static void recover_table_range(struct insane_c *ctx, u64 block, int device_number,
+				unsigned int count, struct recover_stripe *result);
+
+// Geometry comes from placement map in configure
+struct insane_algorithm table_alg = {
+	.name       = "table",
+	.map        = algorithm_table,
+	.recover    = recover_table,
+	.map_range  = algorithm_table_range,
+	.recover_range = recover_table_range,
+	.configure  = table_configure,
+	.destroy    = table_destroy,
+	.module     = THIS_MODULE
+};
+
+// Firmware loader needs a device
+static struct device *table_device;
+
+// One slot of layout period
+struct table_slot
+{
+	u8  role;
+	u8  parity_count;
+	u8  read_count;
+	u16 write_slot;
+	u16 parity[MAX_SYNDROMES];
+	u16 read[MAX_LENGTH];
+};
+
+// Per-device placement map, ctx->alg_data
+struct table_data
+{
+	int parity_count;
+	u16 parity[MAX_SYNDROMES]; // All syndromes of period
+	u16 *data;                 // Data slots, indexed by vs_position
+	struct table_slot slot[0];
+};
+
+static void algorithm_table( struct insane_c *ctx, u64 block, sector_t *sector, int *device_number, struct parity_places *parity )
+{
+	struct table_data *data = ctx->alg_data;
+	struct table_slot *place;
+
+	u64 virtual_stripe, stripe_start;
+	u32 vs_position;
+	sector_t block_offset;
+	int i;
+
+	virtual_stripe = *device_number + block * ctx->ndev;
+	vs_position = insane_div(virtual_stripe, &ctx->data_div);
+	place = &data->slot[data->data[vs_position]];
+
+	stripe_start = virtual_stripe * ctx->stripe_blocks;
+
+	block_offset = *sector & (ctx->chunk_size - 1);
+	insane_lane_place(ctx, stripe_start + data->data[vs_position], device_number, sector);
+	*sector += block_offset;
+
+	if (!parity)
+		return;
+
+	insane_lane_place(ctx, stripe_start, &parity->start_device, &parity->start_sector);
+
+	// Sequential mode writes all syndromes once per stripe,
+	// random mode updates syndromes of the block only
+	if (ctx->io_pattern == SEQUENTIAL) {
+		for (i = 0; i < data->parity_count; i++)
+			insane_lane_place(ctx, stripe_start + data->parity[i],
+					  &parity->device_number[i], &parity->sector_number[i]);
+	} else {
+		for (i = 0; i < place->parity_count; i++)
+			insane_lane_place(ctx, stripe_start + place->parity[i],
+					  &parity->device_number[i], &parity->sector_number[i]);
+	}
+	parity->count = i;
+
+	parity->last_block = false;
+	if (ctx->io_pattern == SEQUENTIAL)
+		parity->last_block = (vs_position == ctx->stripe_blocks - ctx->p_blocks - ctx->e_blocks - 1);
+}
+
+static void table_recover_block(struct insane_c *ctx, u64 stripe_number, int block_in_stripe,
+				struct recover_stripe *result)
+{
+	struct table_data *data = ctx->alg_data;
+	struct table_slot *place = &data->slot[block_in_stripe];
+	u64 stripe_start;
+	int i;
+
+	if (place->write_slot == TABLE_NONE) {
+		result->quantity = 0;
+		result->write_device = -1;
+		return;
+	}
+
+	stripe_start = stripe_number * ctx->stripe_blocks;
+
+	for (i = 0; i < place->read_count; i++)
+		insane_lane_place(ctx, stripe_start + place->read[i],
+				  &result->read_device[i], &result->read_sector[i]);
+	result->quantity = i;
+
+	insane_lane_place(ctx, stripe_start + place->write_slot,
+			  &result->write_device, &result->write_sector);
+}
+
+static struct recover_stripe recover_table(struct insane_c *ctx, u64 block, int device_number)
+{
+	struct recover_stripe result;
+	u64 stripe_number;
+	int block_in_stripe;
+
+	stripe_number = block * ctx->ndev + device_number;
+	block_in_stripe = insane_div(stripe_number, &ctx->stripe_div);
+
+	table_recover_block(ctx, stripe_number, block_in_stripe, &result);
+	return result;
+}
+
+// Next block of device is ndev blocks further in lane order
+static void recover_table_range(struct insane_c *ctx, u64 block, int device_number,
+				unsigned int count, struct recover_stripe *result)
+{
+	u64 stripe_number;
+	unsigned int i, block_in_stripe;
+
+	stripe_number = block * ctx->ndev + device_number;
+	block_in_stripe = insane_div(stripe_number, &ctx->stripe_div);
+
+	for (i = 0; i < count; i++) {
+		table_recover_block(ctx, stripe_number, block_in_stripe, &result[i]);
+
+		block_in_stripe += ctx->ndev;
+		while (block_in_stripe >= ctx->stripe_blocks) {
+			block_in_stripe -= ctx->stripe_blocks;
+			stripe_number++;
+		}
+	}
+}
+
+static void algorithm_table_range( struct insane_c *ctx, u64 chunk, unsigned int count, sector_t *sector, int *device_number )
+{
+	struct table_data *data = ctx->alg_data;
+	u64 stripe_start;
+	unsigned int i, vs_position, data_blocks;
+
+	data_blocks = ctx->stripe_blocks - ctx->p_blocks - ctx->e_blocks;
+	vs_position = insane_div(chunk, &ctx->data_div);
+	stripe_start = chunk * ctx->stripe_blocks;
+
+	for (i = 0; i < count; i++) {
+		insane_lane_place(ctx, stripe_start + data->data[vs_position],
+				  &device_number[i], &sector[i]);
+
+		if (++vs_position == data_blocks) {
+			vs_position = 0;
+			stripe_start += ctx->stripe_blocks;
+		}
+	}
+}
+
+// Read slot list and check that every entry is inside the period
+static int table_read_list(const u8 *buf, size_t size, size_t *pos, u16 *list, int count, int slots)
+{
+	int i;
+
+	if (*pos + count * 2 > size)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++, *pos += 2) {
+		list[i] = get_unaligned_le16(buf + *pos);
+		if (list[i] >= slots)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+// Parse placement map into per-device tables
+static int table_build( struct insane_c *ctx, const u8 *buf, size_t size )
+{
+	struct table_data *data;
+	struct table_slot *place;
+	size_t pos;
+	int slots, data_blocks, empty, i, j, r;
+
+	if (size < 8 || get_unaligned_le32(buf) != TABLE_MAGIC)
+		return -EINVAL;
+	if (get_unaligned_le16(buf + 4) != TABLE_VERSION)
+		return -EINVAL;
+
+	slots = get_unaligned_le16(buf + 6);
+	if (!slots || slots > TABLE_MAX_SLOTS)
+		return -EINVAL;
+
+	data = kzalloc(sizeof(*data) + sizeof(data->slot[0]) * slots +
+		       sizeof(data->data[0]) * slots, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+	data->data = (u16 *)&data->slot[slots];
+
+	data_blocks = 0;
+	empty = 0;
+	r = 0;
+	pos = 8;
+	for (i = 0; i < slots && !r; i++) {
+		place = &data->slot[i];
+
+		if (pos + 6 > size) {
+			r = -EINVAL;
+			break;
+		}
+		place->role = buf[pos];
+		place->parity_count = buf[pos + 1];
+		place->read_count = buf[pos + 2];
+		place->write_slot = get_unaligned_le16(buf + pos + 4);
+		pos += 6;
+
+		if (place->parity_count > MAX_SYNDROMES || place->read_count > MAX_LENGTH ||
+		    (place->write_slot != TABLE_NONE && place->write_slot >= slots)) {
+			r = -EINVAL;
+			break;
+		}
+
+		r = table_read_list(buf, size, &pos, place->parity, place->parity_count, slots);
+		if (!r)
+			r = table_read_list(buf, size, &pos, place->read, place->read_count, slots);
+
+		switch (place->role) {
+		case TABLE_DATA:
+			data->data[data_blocks++] = i;
+			break;
+		case TABLE_PARITY:
+			if (data->parity_count == MAX_SYNDROMES)
+				r = -EINVAL;
+			else
+				data->parity[data->parity_count++] = i;
+			break;
+		case TABLE_EMPTY:
+			empty++;
+			break;
+		default:
+			r = -EINVAL;
+		}
+	}
+
+	if (!r && (pos != size || !data_blocks))
+		r = -EINVAL;
+
+	// Syndromes updated by data blocks must be parity slots
+	for (i = 0; i < slots && !r; i++) {
+		place = &data->slot[i];
+		for (j = 0; j < place->parity_count; j++) {
+			if (data->slot[place->parity[j]].role != TABLE_PARITY)
+				r = -EINVAL;
+		}
+	}
+
+	if (r) {
+		kfree(data);
+		return r;
+	}
+
+	ctx->stripe_blocks = slots;
+	ctx->p_blocks = data->parity_count;
+	ctx->e_blocks = empty;
+	ctx->alg_data = data;
+	return 0;
+}
+
+static int table_configure( struct insane_c *ctx )
+{
+	const struct firmware *fw;
+	const char *name;
+	int r;
+
+	if (!ctx)
+		return -EINVAL;
+
+	name = ctx->alg_args ? ctx->alg_args : TABLE_DEFAULT_FILE;
+
+	r = request_firmware(&fw, name, table_device);
+	if (r) {
+		dm_log("Failed to load placement map %s: %d\n", name, r);
+		return r;
+	}
+
+	r = table_build(ctx, fw->data, fw->size);
+	if (r)
+		dm_log("Invalid placement map %s\n", name);
+	else
+		dm_log("Placement map %s: %u slots, %u parity, %u empty\n",
+		       name, ctx->stripe_blocks, ctx->p_blocks, ctx->e_blocks);
+
+	release_firmware(fw);
+	return r;
+}
+
+static void table_destroy( struct insane_c *ctx )
+{
+	kfree(ctx->alg_data);
+}
+
+static int __init insane_table_init( void )
+{
+	int r;
+
+	table_device = root_device_register("insane_table");
+	if (IS_ERR(table_device))
+		return PTR_ERR(table_device);
+
+	r = insane_register( &table_alg );
+	if (r) {
+		root_device_unregister(table_device);
+		return r;
+	}
+
+	return 0;
+}
+
+static void __exit insane_table_exit( void )
+{
+	insane_unregister( &table_alg );
+	root_device_unregister(table_device);
+}
+
+module_init(insane_table_init);
+module_exit(insane_table_exit);
+
+MODULE_LICENSE("GPL");
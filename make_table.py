@@ -0,0 +1,78 @@
+#!/usr/bin/python
+# -*- coding: UTF-8 -*-
+"""Makes placement map for 'table' algorithm from LRC scheme.
+Usage: 'python make_table.py <scheme> <file>', e.g.
+'python make_table.py 111s1222s2333s3eg insane_table.bin'.
+Put the file to /lib/firmware and create device with 'table:<file>'.
+"""
+
+import struct
+import sys
+
+TABLE_MAGIC = 0x42545349
+TABLE_VERSION = 1
+TABLE_NONE = 0xffff
+
+TABLE_DATA = 0
+TABLE_PARITY = 1
+TABLE_EMPTY = 2
+
+def parse_scheme(scheme):
+    """Returns list of (role, group) by slot, group is None for
+    global syndrome and empty block"""
+    slots = []
+    i = 0
+    while i < len(scheme):
+        c = scheme[i]
+        if c.isdigit():
+            slots.append((TABLE_DATA, int(c)))
+        elif c in 'sS':
+            i += 1
+            slots.append((TABLE_PARITY, int(scheme[i])))
+        elif c in 'eE':
+            slots.append((TABLE_EMPTY, None))
+        elif c in 'gG':
+            slots.append((TABLE_PARITY, None))
+        else:
+            raise ValueError('invalid scheme symbol %s' % c)
+        i += 1
+    return slots
+
+def make_table(scheme):
+    slots = parse_scheme(scheme)
+    empty = [n for n, s in enumerate(slots) if s[0] == TABLE_EMPTY]
+    gs = [n for n, s in enumerate(slots) if s == (TABLE_PARITY, None)]
+    data = [n for n, s in enumerate(slots) if s[0] == TABLE_DATA]
+    if len(empty) != 1:
+        raise ValueError('scheme must have exactly one empty block')
+
+    out = struct.pack('<IHH', TABLE_MAGIC, TABLE_VERSION, len(slots))
+    for n, (role, group) in enumerate(slots):
+        parity = []
+        if role == TABLE_EMPTY:
+            read = []
+            write = TABLE_NONE
+        elif group is None:
+            # global syndrome is rebuilt from all data blocks
+            read = data
+            write = empty[0]
+        else:
+            # block of group is rebuilt from rest of group and its syndrome
+            read = [m for m, s in enumerate(slots) if s[1] == group and m != n]
+            write = empty[0]
+        if role == TABLE_DATA:
+            ls = [m for m, s in enumerate(slots) if s == (TABLE_PARITY, group)]
+            parity = ls + gs
+
+        out += struct.pack('<BBBBH', role, len(parity), len(read), 0, write)
+        out += struct.pack('<%dH' % len(parity), *parity)
+        out += struct.pack('<%dH' % len(read), *read)
+    return out
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print(__doc__)
+        sys.exit(1)
+
+    with open(sys.argv[2], 'wb') as f:
+        f.write(make_table(sys.argv[1]))
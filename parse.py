@@ -260,12 +260,11 @@ for i in xrange(len(tests)):
             else:
                 get_scheme = search_scheme(param)
 
-        new_info = defines(get_scheme)
-        new_info += constants(get_scheme)
-        with open('lrc_config.c', 'w') as f:
-            f.writelines(new_info)
+        # Схема передается модулю в таблице, пересборка не нужна
+        algorithm = '%s:%s' % (test1[1], get_scheme)
     else:
         get_scheme = ''
+        algorithm = test1[1]
 
     parts = []
     for j in xrange(disks_count):
@@ -281,7 +280,7 @@ for i in xrange(len(tests)):
     array_speed = []
     for k in xrange(len(sizes)):
         with open('TABLE', 'w') as table:
-            table.write('0 %s insane %s %s %s recover 1 %s\n' % (size_block, test1[1], disks_count, int(sizes[k]), disks))#+размер блоков и тд
+            table.write('0 %s insane %s %s %s recover 1 %s\n' % (size_block, algorithm, disks_count, int(sizes[k]), disks))#+размер блоков и тд
 
         # запуск bash скриптов
         subprocess.call('./run_up')